@@ -5,7 +5,14 @@
 @author t-sakai
 @date 2008/11/13 create
 */
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include "common.h"
 //#define TREE_AVLTREE_ENABLE_DEBUGPRINT
 
@@ -17,6 +24,13 @@ namespace tree
         AVLSub_Right=1,
     };
 
+    enum TraversalOrder
+    {
+        TraversalOrder_InOrder=0,
+        TraversalOrder_PreOrder=1,
+        TraversalOrder_PostOrder=2,
+    };
+
     //---------------------------------------------------------------
     //---
     //--- AVLNode
@@ -27,8 +41,10 @@ namespace tree
     {
     public:
         s32& getSub(s32 s){ return (s==AVLSub_Left)? left_ : right_;}
+        s32 getSub(s32 s) const{ return (s==AVLSub_Left)? left_ : right_;}
 
         s32 balance_;
+        s32 parent_;
         s32 left_;
         s32 right_;
         T value_;
@@ -40,7 +56,7 @@ namespace tree
         {}
 
         template<class T>
-        inline T* malloc(u32 size)
+        inline T* malloc(size_t size)
         {
             return reinterpret_cast<T*>(DefaultAllocator::malloc(size));
         }
@@ -52,6 +68,26 @@ namespace tree
         }
     };
 
+    /**
+    @brief Least string greater than all strings which start with the prefix
+    @return false if there is no such string
+    */
+    template<class C, class Traits, class Alloc>
+    bool prefix_upper_bound(std::basic_string<C, Traits, Alloc>& upper, const std::basic_string<C, Traits, Alloc>& prefix)
+    {
+        typedef typename std::make_unsigned<C>::type unsigned_type;
+        upper = prefix;
+        while(!upper.empty()){
+            unsigned_type last = static_cast<unsigned_type>(upper[upper.size()-1]);
+            if(last < std::numeric_limits<unsigned_type>::max()){
+                upper[upper.size()-1] = static_cast<C>(last+1);
+                return true;
+            }
+            upper.resize(upper.size()-1);
+        }
+        return false;
+    }
+
     //---------------------------------------------------------------
     //---
     //--- AVLTree
@@ -62,7 +98,14 @@ namespace tree
     class AVLTree
     {
     public:
-        static const s32 MaxLevels = 32;
+        /// Upper bound of the height, an AVL tree of 2^31 nodes is at most 1.44*log2(n+2) = 45 levels high
+        static const s32 MaxLevels = 48;
+        static const s32 BatchLanes = 16;
+        static const s32 MaxParallelLevels = 10;
+        /// Batches larger than size()/BatchMergeRatio are merged with the tree in one ordered pass
+        static const s32 BatchMergeRatio = 8;
+        /// The parallel set operations fork at the subtrees at least this height
+        static const s32 ParallelMinHeight = 12;
 
         typedef u32 size_type;
         typedef T* pointer;
@@ -78,28 +121,511 @@ namespace tree
 
         typedef s32 iterator_type;
 
+        /**
+        @brief Bidirectional iterator, converts to iterator_type implicitly
+        */
+        template<class Tree, class Value>
+        class Iterator
+        {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef ptrdiff_t difference_type;
+            typedef Value* pointer;
+            typedef Value& reference;
+
+            Iterator()
+                :tree_(NULL)
+                ,node_(-1)
+            {}
+
+            Iterator(Tree* tree, s32 node)
+                :tree_(tree)
+                ,node_(node)
+            {}
+
+            template<class Tree2, class Value2>
+            Iterator(const Iterator<Tree2, Value2>& rhs)
+                :tree_(rhs.tree_)
+                ,node_(rhs.node_)
+            {}
+
+            operator iterator_type() const
+            {
+                return node_;
+            }
+
+            reference operator*() const
+            {
+                return tree_->nodes_[node_].value_;
+            }
+
+            pointer operator->() const
+            {
+                return &tree_->nodes_[node_].value_;
+            }
+
+            Iterator& operator++()
+            {
+                node_ = tree_->successor(node_);
+                return *this;
+            }
+
+            Iterator operator++(int)
+            {
+                Iterator tmp(*this);
+                node_ = tree_->successor(node_);
+                return tmp;
+            }
+
+            Iterator& operator--()
+            {
+                node_ = (node_<0)? tree_->rightmost_ : tree_->predecessor(node_);
+                return *this;
+            }
+
+            Iterator operator--(int)
+            {
+                Iterator tmp(*this);
+                --(*this);
+                return tmp;
+            }
+
+            bool operator==(const Iterator& rhs) const
+            {
+                return node_ == rhs.node_;
+            }
+
+            bool operator!=(const Iterator& rhs) const
+            {
+                return node_ != rhs.node_;
+            }
+
+        private:
+            template<class Tree2, class Value2> friend class Iterator;
+
+            Tree* tree_;
+            s32 node_;
+        };
+
+        typedef Iterator<this_type, T> iterator;
+        typedef Iterator<const this_type, const T> const_iterator;
+        typedef std::reverse_iterator<iterator> reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+        /**
+        @brief Owner of a value extracted from a tree
+
+        The value stays in the node of the source tree, unlinked from it,
+        so the source tree should outlive the handle.
+        The value is destroyed if the handle is not inserted into a tree.
+        The operations which rebuild or exchange the pool of the source tree (build_from_sorted, the batches,
+        swap, split, join and the set operations) assert that no handle of the tree is outstanding.
+        */
+        class NodeHandle
+        {
+        public:
+            NodeHandle()
+                :tree_(NULL)
+                ,node_(-1)
+            {}
+
+            NodeHandle(NodeHandle&& rhs)
+                :tree_(rhs.tree_)
+                ,node_(rhs.node_)
+            {
+                rhs.tree_ = NULL;
+                rhs.node_ = -1;
+            }
+
+            ~NodeHandle()
+            {
+                release();
+            }
+
+            NodeHandle& operator=(NodeHandle&& rhs)
+            {
+                if(this != &rhs){
+                    release();
+                    tree_ = rhs.tree_;
+                    node_ = rhs.node_;
+                    rhs.tree_ = NULL;
+                    rhs.node_ = -1;
+                }
+                return *this;
+            }
+
+            bool empty() const
+            {
+                return NULL == tree_;
+            }
+
+            explicit operator bool() const
+            {
+                return NULL != tree_;
+            }
+
+            /// The reference is invalidated by inserting into the source tree, as get()
+            value_type& value() const
+            {
+                TASSERT(NULL != tree_);
+                return tree_->nodes_[node_].value_;
+            }
+
+        private:
+            friend class AVLTree;
+
+            NodeHandle(const NodeHandle&) = delete;
+            NodeHandle& operator=(const NodeHandle&) = delete;
+
+            NodeHandle(this_type* tree, s32 node)
+                :tree_(tree)
+                ,node_(node)
+            {
+                ++tree_->handles_;
+            }
+
+            void release()
+            {
+                if(NULL != tree_){
+                    --tree_->handles_;
+                    tree_->destroy(node_);
+                    tree_ = NULL;
+                    node_ = -1;
+                }
+            }
+
+            this_type* tree_;
+            s32 node_;
+        };
+
+        typedef NodeHandle node_handle;
+
         AVLTree();
         ~AVLTree();
 
+        /// O(1), except the first call after a split or a join in a shared pool counts the values in O(n)
         inline s32 size() const;
 
+        /// Not thread-safe while the path cache is enabled, see enable_path_cache
         iterator_type find(const value_type& value) const;
         inline iterator_type find(const value_type& value);
 
         iterator_type find(const value_type& value, std::function<s32(const T&, const T&)> comp) const;
         inline iterator_type find(const value_type& value, std::function<s32(const T&, const T&)> comp);
 
-        inline iterator_type end() const;
+        /**
+        @brief Find values[i] for each i, results[i] receives the position or end()
+        Descents are interleaved in groups of BatchLanes and next nodes are prefetched.
+        */
+        void find_batch(const value_type* values, iterator_type* results, s32 count) const;
+
+        /**
+        @brief Find values[i] for each i, values should be sorted in ascending order
+        Each search resumes from the deepest node of the previous path whose range still contains the value.
+        */
+        void find_sorted_batch(const value_type* values, iterator_type* results, s32 count) const;
+
+        /**
+        @brief Enable or disable the path cache
+        While enabled, find resumes from the deepest node of the previous path whose range still contains the value.
+        find updates the cache even on a const tree, so it must not be called concurrently while the cache is enabled,
+        including from find_batch callers and parallel_for_each visitors on other threads.
+        */
+        void enable_path_cache(bool enable);
+        inline bool is_path_cache_enabled() const;
+        /// Number of finds which resumed below the root
+        inline u32 path_cache_hits() const;
+        /// Number of finds which started from the root
+        inline u32 path_cache_misses() const;
+
+        /// First position whose value is not less than the value
+        iterator_type lower_bound(const value_type& value) const;
+        /// First position whose value is greater than the value
+        iterator_type upper_bound(const value_type& value) const;
+        /// Range [lower_bound, upper_bound) of the value
+        inline std::pair<iterator_type, iterator_type> equal_range(const value_type& value) const;
+        /// Position of the greatest value not greater than the value
+        iterator_type floor(const value_type& value) const;
+        /// Position of the least value not less than the value
+        inline iterator_type ceiling(const value_type& value) const;
+
+        /**
+        @brief First position whose value satisfies the predicate
+        @param predicate ... bool(const T&), should be false for a prefix of the ordered values and true for the rest
+        */
+        template<class Predicate>
+        iterator_type descend(Predicate predicate) const;
+
+        /**
+        @brief Find the value, searching from a known position
+        Comparisons are O(log d) in the distance d between the position and the value.
+        */
+        iterator_type finger_find(iterator_type from, const value_type& value) const;
+
+        inline iterator begin();
+        inline const_iterator begin() const;
+        inline iterator end();
+        inline const_iterator end() const;
+        inline reverse_iterator rbegin();
+        inline const_reverse_iterator rbegin() const;
+        inline reverse_iterator rend();
+        inline const_reverse_iterator rend() const;
+        /// Iterator at the position
+        inline iterator to_iterator(iterator_type pos);
+        inline const_iterator to_iterator(iterator_type pos) const;
 
         inline const value_type& get(iterator_type pos) const;
         inline value_type& get(iterator_type pos);
 
         inline void insert(value_type&& value);
+        /**
+        @brief Insert the value, searching from the hint
+        @return position of the inserted value, or the equivalent value already in the tree
+        Comparisons are O(log d) in the distance d between the hint and the value.
+        */
+        iterator_type insert(iterator_type hint, value_type&& value);
+        /**
+        @brief Insert the value, which is expected to be greater than any value in the tree
+        @return position of the inserted value, or the equivalent value already in the tree
+        Appending costs one comparison and amortized O(1) rebalancing along the right spine.
+        */
+        iterator_type push_back(value_type&& value);
+
+        /**
+        @brief Construct a value in a node, and insert it
+        @return position of the value and true, or the equivalent value already in the tree and false
+        */
+        template<class... Args>
+        std::pair<iterator_type, bool> emplace(Args&&... args);
+
+        /**
+        @brief Construct a value in a node from the arguments, only if no value is equivalent to the key
+        @param key ... compared as comparator(value, key), so the comparator may take a key of another type
+        @return position of the value and true, or the equivalent value already in the tree and false
+        */
+        template<class Key, class... Args>
+        std::pair<iterator_type, bool> try_emplace(const Key& key, Args&&... args);
+
+        /**
+        @brief Insert the value, or assign it to the equivalent value, with one descent
+        @return position of the value and true if inserted, false if assigned
+        */
+        std::pair<iterator_type, bool> insert_or_assign(value_type&& value);
+
+        /**
+        @brief Update the value equivalent to the key, or insert a created value, with one descent
+        @param key ... compared as comparator(value, key)
+        @param update ... called as update(value_type&) if found, must keep the order of the value
+        @param creator ... called as creator(key) returning value_type if not found
+        @return position of the value and true if inserted, false if updated
+        */
+        template<class Key, class Update, class Creator>
+        std::pair<iterator_type, bool> upsert(const Key& key, Update update, Creator creator);
+
         void remove(const value_type& value);
+
+        /**
+        @brief Remove the value at the position, without searching the value
+        @return position of the next value, or end()
+        */
+        iterator_type erase(iterator_type pos);
+
+        /**
+        @brief Remove the value at the position and move it out, without searching the value
+        */
+        value_type extract(iterator_type pos);
+
+        /**
+        @brief Remove the values in [lower, upper) at once
+        The range is split off and its nodes are destroyed in bulk, O(log n + k) for k removed values.
+        @return number of removed values
+        */
+        s32 erase_range(const value_type& lower, const value_type& upper);
+
+        /**
+        @brief Unlink the node at the position, the handle owns the value
+        */
+        node_handle extract_node(iterator_type pos);
+
+        /**
+        @brief Insert the value owned by the handle
+
+        The node is linked as it is if the handle came from this tree, otherwise the value is moved once.
+        The handle keeps the value if an equivalent value is already in the tree.
+        @return position of the value and true, or the equivalent value already in the tree and false
+        */
+        std::pair<iterator_type, bool> insert(node_handle&& handle);
+
+        /// Position of the least value, or end() if empty
+        inline iterator_type min() const;
+        /// Position of the greatest value, or end() if empty
+        inline iterator_type max() const;
+        /// Remove the least value
+        void pop_min();
+        /// Remove the greatest value
+        void pop_max();
         void clear();
 
+        /**
+        @brief Replace the values with the sorted values in O(n), without comparisons
+        @param values ... strictly ascending, moved into the tree
+        @param count ... number of values
+
+        The nodes are laid out in breadth first order, so the upper levels share cache lines.
+        The handles extracted from this tree should be released before.
+        */
+        void build_from_sorted(value_type* values, s32 count);
+
+        /**
+        @brief Insert the values, which are sorted in place and moved into the tree
+        @return number of inserted values, the values equivalent to the others are not inserted
+
+        A large batch is merged with the tree in one ordered pass and rebuilt,
+        a small one is inserted in order with the previous position as the hint.
+        The handles extracted from this tree should be released before, as the pool may be rebuilt.
+        */
+        s32 insert_batch(value_type* values, s32 count);
+
+        /**
+        @brief Remove the values, which are sorted in place
+        @return number of removed values
+
+        A large batch is merged with the tree in one ordered pass and rebuilt,
+        a small one is removed in order with the next position as the finger.
+        The handles extracted from this tree should be released before, as the pool may be rebuilt.
+        */
+        s32 remove_batch(value_type* values, s32 count);
+
+        /// Exchange the pools, the handles extracted from either tree should be released before
         void swap(AVLTree& rhs);
 
+        /**
+        @brief Clear this tree, and take the nodes from the pool of other from now on
+        The trees in a pool hand the nodes over by relinking them, so split and join are O(log n).
+        The pool is freed with the last tree, so the allocators should be able to free each other's memory.
+        The trees in a pool should not be modified concurrently. The handles extracted from this tree should be released before.
+        */
+        void share_pool(AVLTree& other);
+        /// Whether the nodes of both trees are in the same pool
+        inline bool shares_pool(const AVLTree& other) const;
+
+        /**
+        @brief Move the values not less than the key into right, which is cleared
+        If the trees share a pool, both parts stay in place, and the split is O(log n).
+        The sizes of the parts are counted by the next call of size().
+        Otherwise the values of the part of the smaller height are moved to the other tree's nodes one by one,
+        which is O(n) for a split near the median.
+        The handles extracted from either tree should be released before.
+        */
+        void split(const value_type& key, AVLTree& right);
+
+        /**
+        @brief Move all values of right, which should be greater than the values of this tree, into this tree
+        If the trees share a pool, the join relinks O(log n) nodes. The size is counted by the next call of size()
+        unless both sizes are known.
+        Otherwise the values of the tree of the smaller height are moved one by one into the other tree's nodes,
+        which is O(n) for trees of similar sizes.
+        The handles extracted from either tree should be released before.
+        */
+        void join(AVLTree& right);
+
+        /**
+        @brief Set operations with other, which becomes empty. Values of this tree are kept for equivalent values
+        The result is made by splits and joins recursing over the smaller tree, O(m log(n/m+1)) for the sizes m<=n.
+        The values not in the result are destroyed. Only set_union moves values, the ones of the smaller tree
+        into the other's pool, unless the trees share a pool. The handles extracted from either tree should be released before.
+        */
+        void set_union(AVLTree& other);
+        void set_intersection(AVLTree& other);
+        void set_difference(AVLTree& other);
+
+        /**
+        @brief Set operations into result as a new tree, this tree and other are not changed
+        Values of this tree are copied for equivalent values, and result is rebuilt by build_from_sorted.
+        set_intersection, and set_difference from the smaller tree, iterate the smaller tree of m values
+        and search the larger one from the previous match, O(m log(n/m+1)).
+        The other cases have O(n) values in the result, so both trees are read in one ordered pass, O(n+m).
+        */
+        void set_union(const AVLTree& other, AVLTree& result) const;
+        void set_intersection(const AVLTree& other, AVLTree& result) const;
+        void set_difference(const AVLTree& other, AVLTree& result) const;
+
+        /**
+        @brief Set operations with the tasks of the pool, the two halves of each split are processed in parallel
+        The results are the same as the sequential ones. The destroyed nodes are gathered per task
+        and returned to the free list at the end.
+        @param pool ... WorkStealingPool like, with spawn(group, task) and wait(group)
+        */
+        template<class Pool>
+        void parallel_set_union(Pool& pool, AVLTree& other);
+        template<class Pool>
+        void parallel_set_intersection(Pool& pool, AVLTree& other);
+        template<class Pool>
+        void parallel_set_difference(Pool& pool, AVLTree& other);
+
+        /**
+        @brief insert_batch and remove_batch with the tasks of the pool
+        The inserted values are built into a tree, then united in parallel.
+        The removed values are split in halves along the recursion in place, so they are not moved.
+        */
+        template<class Pool>
+        s32 parallel_insert_batch(Pool& pool, value_type* values, s32 count);
+        template<class Pool>
+        s32 parallel_remove_batch(Pool& pool, value_type* values, s32 count);
+
+        /**
+        @brief Visit all values in the order, without recursion
+        @param visitor ... DefaultTraversal like functor, the traversal stops if it returns false
+        @return false if the visitor stopped the traversal
+        */
+        template<s32 Order, class Visitor>
+        inline bool traverse(Visitor& visitor);
+        template<s32 Order, class Visitor>
+        inline bool traverse(Visitor& visitor) const;
+
+        /**
+        @brief Visit the values in [lower, upper) in order
+        @param visitor ... DefaultTraversal like functor, the scan stops if it returns false
+        @return false if the visitor stopped the scan
+        */
+        template<class Visitor>
+        inline bool scan(const value_type& lower, const value_type& upper, Visitor& visitor);
+        template<class Visitor>
+        inline bool scan(const value_type& lower, const value_type& upper, Visitor& visitor) const;
+
+        /**
+        @brief Visit the values which start with the prefix in order
+        The range is [prefix, upper), where upper is computed by prefix_upper_bound(upper, prefix) found by ADL.
+        */
+        template<class Visitor>
+        bool prefix_scan(const value_type& prefix, Visitor& visitor);
+        template<class Visitor>
+        bool prefix_scan(const value_type& prefix, Visitor& visitor) const;
+
+        /**
+        @brief Visit all values with the tasks of the pool, the visitor is called concurrently
+        The tree is split into subtrees at the upper levels, each task visits a subtree in order.
+        @param pool ... WorkStealingPool like, with size(), spawn(group, task) and wait(group)
+        */
+        template<class Pool, class Visitor>
+        void parallel_for_each(Pool& pool, Visitor& visitor);
+
+        /**
+        @brief Split the values into contiguous chunks, and visit each chunk in order with own copy of the visitor
+        @return number of chunks (at most maxChunks), chunks[i] has visited the i-th chunk
+        */
+        template<class Pool, class Visitor>
+        s32 parallel_for_each_ordered(Pool& pool, const Visitor& visitor, Visitor* chunks, s32 maxChunks);
+
+        /**
+        @brief Split [lower, upper) into sub-ranges with approximately equal numbers of values
+        The sizes are estimated from the heights of the subtrees below the sampled upper levels.
+        @param bounds ... receives count+1 positions at most, the i-th sub-range is [bounds[i], bounds[i+1])
+        @return number of sub-ranges, which is less than count if there are not enough values
+        */
+        s32 partition(const value_type& lower, const value_type& upper, s32 count, iterator_type* bounds) const;
+
 #ifdef TREE_AVLTREE_ENABLE_DEBUGPRINT
         void print();
 #endif
@@ -115,14 +641,146 @@ namespace tree
 
         void updateBalance(s32 node);
 
-        s32 insertInternal(s32 node, value_type&& value);
+        s32 insertInternal(s32 node, Step* path, s32 level, value_type&& value);
+        void attach(s32 node, Step* path, s32 level);
         s32 balanceInsert(s32 node, Step* path, s32 numLevels);
 
-        s32 findInternal(s32 node, Step* path, s32& level, const value_type& value);
+        template<class Key>
+        s32 findInternal(s32 node, Step* path, s32& level, const Key& value) const;
+        iterator_type findCached(const value_type& value) const;
+        s32 fingerStart(s32 node, const value_type& value) const;
+        s32 buildPath(s32 node, Step* path) const;
+        inline void resetPathCache();
+
+        void eraseInternal(s32 n, Step* path, s32 numLevels);
+        void detach(s32 n, Step* path, s32 numLevels);
+        s32 successor(s32 node) const;
 
+        enum SetOperation
+        {
+            SetOperation_Union=0,
+            SetOperation_Intersection=1,
+            SetOperation_Difference=2,
+        };
+        void copySetOperation(const AVLTree& other, AVLTree& result, SetOperation operation) const;
+        s32 predecessor(s32 node) const;
         void balanceRemove(Step* path, s32 numLevels);
+        inline void replaceChild(const Step* path, s32 level, s32 node);
+
+        s32 clearInternal(s32 node);
+        s32 countInternal(s32 node) const;
+        inline void addSize(s32 count);
+        bool fewerNodes(const AVLTree& other) const;
+        s32 buildInternal(value_type* values, s32 count, s32 parent);
+        s32 sortUnique(value_type* values, s32 count) const;
+
+        template<s32 Order, class Node, class Visitor>
+        static bool traverseInternal(Node* nodes, s32 root, Visitor& visitor);
+        struct ParallelItem
+        {
+            s32 node_;
+            s32 subtree_; //Visit whole subtree, or the node only
+        };
+        static s32 parallelLevels(s32 count);
+        s32 gatherParallelItems(s32 node, s32 level, s32 levels, ParallelItem* items, s32 count) const;
+
+        struct PartitionItem
+        {
+            s32 node_;
+            s32 weight_; //Estimated size of the subtree, or 0 for a single node in the range
+        };
+        s32 gatherPartitionItems(s32 node, s32 level, s32 levels, const value_type& lower, const value_type& upper, PartitionItem* items, s32 count) const;
+        s32 height(s32 node) const;
+        inline void childHeights(s32 node, s32 height, s32& leftHeight, s32& rightHeight) const;
+        s32 joinInternal(s32 left, s32 leftHeight, s32 middle, s32 right, s32 rightHeight, s32& height);
+        s32 rebalanceJoin(s32 node, s32 leftHeight, s32 rightHeight, s32& height);
+        s32 splitInternal(s32 node, s32 height, const value_type& key, s32& left, s32& leftHeight, s32& right, s32& rightHeight);
+        s32 popMinInternal(s32 node, s32 height, s32& min, s32& resultHeight);
+        s32 join2Internal(s32 left, s32 leftHeight, s32 right, s32 rightHeight, s32& height);
+        void mergePools(AVLTree& other, s32& root, s32& otherRoot);
+
+        /// Nodes destroyed by a set operation, chained through balance_ until they return to the free list
+        struct Released
+        {
+            s32 head_;
+            s32 tail_;
+        };
+
+        /// Per task state of a set operation
+        struct SetState
+        {
+            s32 matches_;
+            Released released_;
+            Released otherReleased_;
+        };
+
+        /// Process the two halves one by one
+        struct SequentialFork
+        {
+            template<class Left, class Right>
+            void operator()(bool, SetState& state, Left& left, Right& right) const
+            {
+                left(state);
+                right(state);
+            }
+        };
+
+        /// Process the left half in a task with own state, if the halves are large
+        template<class Pool>
+        struct ParallelFork
+        {
+            template<class Left, class Right>
+            void operator()(bool large, SetState& state, Left& left, Right& right) const
+            {
+                if(!large){
+                    left(state);
+                    right(state);
+                    return;
+                }
+                SetState leftState;
+                initState(leftState);
+                typename Pool::TaskGroup group;
+                pool_->spawn(group, [&left, &leftState]{
+                    left(leftState);
+                });
+                right(state);
+                pool_->wait(group);
+                state.matches_ += leftState.matches_;
+                tree_->append(state.released_, leftState.released_);
+                other_->append(state.otherReleased_, leftState.otherReleased_);
+            }
+
+            Pool* pool_;
+            AVLTree* tree_;
+            AVLTree* other_;
+        };
+
+        static void initState(SetState& state);
+        void release(s32 node, Released& released);
+        void releaseInternal(s32 node, Released& released);
+        void append(Released& to, const Released& from);
+        void reclaim(const Released& released);
 
-        void clearInternal(s32 node);
+        template<class Fork>
+        s32 unionTrees(AVLTree& other, const Fork& fork);
+        template<class Fork>
+        void intersectTrees(AVLTree& other, const Fork& fork);
+        template<class Fork>
+        void differenceTrees(AVLTree& other, const Fork& fork);
+        template<class Fork>
+        s32 unionInternal(s32 x, s32 xHeight, s32 y, s32 yHeight, bool keepX, const Fork& fork, SetState& state, s32& height);
+        template<class Fork>
+        s32 intersectionInternal(s32 a, s32 aHeight, AVLTree& other, s32 b, s32 bHeight, bool overA, const Fork& fork, SetState& state, s32& height);
+        template<class Fork>
+        s32 differenceInternal(s32 a, s32 aHeight, AVLTree& other, s32 b, s32 bHeight, bool overA, const Fork& fork, SetState& state, s32& height);
+        template<class Fork>
+        s32 differenceRange(s32 a, s32 aHeight, const value_type* values, s32 count, const Fork& fork, SetState& state, s32& height);
+        void clearOther(AVLTree& other);
+        s32 transplant(AVLTree& source, s32 node, s32 parent, s32& count);
+        void updateEnds();
+
+        template<class Node, class Visitor>
+        bool scanInternal(Node* nodes, const value_type& lower, const value_type* upper, Visitor& visitor) const;
 
 #ifdef TREE_AVLTREE_ENABLE_DEBUGPRINT
         void printInternal(s32 node, s32 level) const;
@@ -134,36 +792,81 @@ namespace tree
         /// Rotate left
         s32 rotateLeft(s32 node);
 
+        void acquirePool();
+        void releasePool();
+        inline bool ownsPool() const;
+        s32 allocate();
+        s32 grownCapacity() const;
+        node_type* allocateNodes(s32 capacity);
+        void relocate(node_type* nodes, s32 capacity);
+        template<class... Args>
+        s32 construct(Args&&... args);
         s32 create(value_type&& value);
+        void deallocate(s32 node);
         void destroy(s32 node);
 
+        /// Nodes and the free list, which the trees sharing the pool refer to
+        struct NodePool
+        {
+            s32 references_;
+            s32 capacity_;
+            s32 empty_; ///< Head of the free list chained through balance_, or -1
+            node_type* items_;
+        };
+
         class Array
         {
         public:
             Array()
-                :capacity_(0)
-                ,items_(NULL)
+                :pool_(NULL)
             {}
 
             const node_type& operator[](s32 index) const
             {
-                TASSERT(0<=index && index<capacity_);
-                return items_[index];
+                TASSERT(0<=index && index<capacity());
+                return pool_->items_[index];
             }
             node_type& operator[](s32 index)
             {
-                TASSERT(0<=index && index<capacity_);
-                return items_[index];
+                TASSERT(0<=index && index<capacity());
+                return pool_->items_[index];
             }
 
-            s32 capacity_;
-            node_type* items_;
+            s32 capacity() const
+            {
+                return (NULL != pool_)? pool_->capacity_ : 0;
+            }
+            node_type* items() const
+            {
+                return (NULL != pool_)? pool_->items_ : NULL;
+            }
+            s32 vacant() const
+            {
+                return (NULL != pool_)? pool_->empty_ : -1;
+            }
+
+            NodePool* pool_; ///< Created at the first allocation
+        };
+        struct PathCache
+        {
+            s32 numLevels_;
+            s32 numUppers_;
+            s32 numLowers_;
+            u32 hits_;
+            u32 misses_;
+            s32 path_[MaxLevels];
+            s32 uppers_[MaxLevels]; //Levels of the path, where the descent turned left
+            s32 lowers_[MaxLevels]; //Levels of the path, where the descent turned right
         };
-        s32 size_;
-        s32 empty_;
+
+        mutable s32 size_; ///< Negative until counted after a split or a join in a shared pool
+        s32 handles_; ///< Number of outstanding handles, which own detached nodes of this tree
         Array nodes_;
+        PathCache* cache_;
 
         s32 root_;
+        s32 leftmost_;
+        s32 rightmost_;
         allocator_type allocator_;
         comparator_type comparator_;
     };
@@ -172,8 +875,11 @@ namespace tree
     template<class T, class Allocator, class Comparator>
     AVLTree<T,Allocator,Comparator>::AVLTree()
         :size_(0)
-        ,empty_(-1)
+        ,handles_(0)
+        ,cache_(NULL)
         ,root_(-1)
+        ,leftmost_(-1)
+        ,rightmost_(-1)
     {
     }
 
@@ -181,17 +887,19 @@ namespace tree
     template<class T, class Allocator, class Comparator>
     AVLTree<T,Allocator,Comparator>::~AVLTree()
     {
+        TASSERT(0 == handles_);
         clear();
-        allocator_.free(nodes_.items_);
-        nodes_.items_ = NULL;
-        nodes_.capacity_ = 0;
-        empty_ = -1;
+        enable_path_cache(false);
+        releasePool();
     }
 
     //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
     inline s32 AVLTree<T, Allocator, Comparator>::size() const
     {
+        if(size_<0){
+            size_ = countInternal(root_);
+        }
         return size_;
     }
 
@@ -200,6 +908,9 @@ namespace tree
     typename AVLTree<T,Allocator,Comparator>::iterator_type
         AVLTree<T,Allocator,Comparator>::find(const value_type& value) const
     {
+        if(NULL != cache_){
+            return findCached(value);
+        }
         s32 node = root_;
         while(0 <= node){
             s32 cmp = comparator_(nodes_[node].value_, value);
@@ -251,207 +962,2426 @@ namespace tree
 
     //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    inline typename AVLTree<T,Allocator,Comparator>::iterator_type
-        AVLTree<T,Allocator,Comparator>::end() const
+    void AVLTree<T, Allocator, Comparator>::find_batch(const value_type* values, iterator_type* results, s32 count) const
     {
-        return -1;
+        TASSERT(0<=count);
+        s32 lanes[BatchLanes];
+        for(s32 base=0; base<count; base+=BatchLanes){
+            s32 active = (BatchLanes<(count-base))? BatchLanes : (count-base);
+            for(s32 i=0; i<active; ++i){
+                lanes[i] = base+i;
+                results[base+i] = root_;
+            }
+            if(root_<0){
+                continue;
+            }
+            //Advance every descent one level per round, so that the loads of the next level overlap
+            while(0<active){
+                for(s32 i=0; i<active;){
+                    s32 index = lanes[i];
+                    s32 node = results[index];
+                    s32 cmp = comparator_(nodes_[node].value_, values[index]);
+                    if(0 != cmp){
+                        node = (cmp<0)? nodes_[node].right_ : nodes_[node].left_;
+                        results[index] = node;
+                        if(0<=node){
+                            TPREFETCH(&nodes_[node]);
+                            ++i;
+                            continue;
+                        }
+                    }
+                    lanes[i] = lanes[--active];
+                }
+            }
+        }
     }
 
+    //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    inline const typename AVLTree<T, Allocator, Comparator>::value_type&
-        AVLTree<T, Allocator, Comparator>::get(iterator_type pos) const
+    void AVLTree<T, Allocator, Comparator>::find_sorted_batch(const value_type* values, iterator_type* results, s32 count) const
     {
-        return nodes_[pos].value_;
+        TASSERT(0<=count);
+        s32 path[MaxLevels];
+        s32 bounds[MaxLevels]; //Levels of the path, where the descent turned left
+        s32 numLevels = 0;
+        s32 numBounds = 0;
+        for(s32 i=0; i<count; ++i){
+            const value_type& value = values[i];
+            //The subtree at path[start] contains the value, if its nearest left turned ancestor is greater than the value
+            s32 start = numLevels-1;
+            while(0<numBounds){
+                s32 level = bounds[numBounds-1];
+                if(0<comparator_(nodes_[path[level]].value_, value)){
+                    break;
+                }
+                start = level;
+                --numBounds;
+            }
+            s32 node;
+            if(start<0){
+                node = root_;
+                numLevels = 0;
+            }else{
+                node = path[start];
+                numLevels = start;
+                if(0<numBounds && start<=bounds[numBounds-1]){
+                    --numBounds;
+                }
+            }
+
+            while(0<=node){
+                TASSERT(numLevels<MaxLevels);
+                path[numLevels++] = node;
+                s32 cmp = comparator_(nodes_[node].value_, value);
+                if(0 == cmp){
+                    break;
+                }else if(cmp<0){
+                    node = nodes_[node].right_;
+                }else{
+                    bounds[numBounds++] = numLevels-1;
+                    node = nodes_[node].left_;
+                }
+            }
+            results[i] = node;
+        }
     }
 
+    //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    inline typename AVLTree<T, Allocator, Comparator>::value_type&
-        AVLTree<T, Allocator, Comparator>::get(iterator_type pos)
+    void AVLTree<T, Allocator, Comparator>::enable_path_cache(bool enable)
     {
-        return nodes_[pos].value_;
+        if(enable){
+            if(NULL == cache_){
+                cache_ = allocator_.template malloc<PathCache>(sizeof(PathCache));
+                cache_->numLevels_ = 0;
+                cache_->numUppers_ = 0;
+                cache_->numLowers_ = 0;
+                cache_->hits_ = 0;
+                cache_->misses_ = 0;
+            }
+        }else if(NULL != cache_){
+            allocator_.free(cache_);
+            cache_ = NULL;
+        }
     }
 
+    //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T,Allocator,Comparator>::updateBalance(s32 node)
+    inline bool AVLTree<T, Allocator, Comparator>::is_path_cache_enabled() const
     {
-        TASSERT(0 <= node);
-
-        s32 left = nodes_[node].left_;
-        s32 right = nodes_[node].right_;
-        TASSERT(0 <= left);
-        TASSERT(0 <= right);
+        return NULL != cache_;
+    }
 
-        if(1 == nodes_[node].balance_){
-            nodes_[left].balance_ = 0;
-            nodes_[right].balance_ = -1;
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline u32 AVLTree<T, Allocator, Comparator>::path_cache_hits() const
+    {
+        return (NULL != cache_)? cache_->hits_ : 0;
+    }
 
-        }else if( -1 == nodes_[node].balance_){
-            nodes_[left].balance_ = 1;
-            nodes_[right].balance_ = 0;
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline u32 AVLTree<T, Allocator, Comparator>::path_cache_misses() const
+    {
+        return (NULL != cache_)? cache_->misses_ : 0;
+    }
 
-        }else{
-            nodes_[left].balance_ = 0;
-            nodes_[right].balance_ = 0;
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::lower_bound(const value_type& value) const
+    {
+        s32 result = -1;
+        s32 node = root_;
+        while(0 <= node){
+            if(0<=comparator_(nodes_[node].value_, value)){
+                result = node;
+                node = nodes_[node].left_;
+            }else{
+                node = nodes_[node].right_;
+            }
         }
-        nodes_[node].balance_ = 0;
+        return result;
     }
 
+    //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    inline void AVLTree<T,Allocator,Comparator>::insert(value_type&& value)
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::upper_bound(const value_type& value) const
     {
-        root_ = insertInternal(root_, tree::move(value));
+        s32 result = -1;
+        s32 node = root_;
+        while(0 <= node){
+            if(0<comparator_(nodes_[node].value_, value)){
+                result = node;
+                node = nodes_[node].left_;
+            }else{
+                node = nodes_[node].right_;
+            }
+        }
+        return result;
     }
 
+    //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T,Allocator,Comparator>::remove(const value_type& value)
+    inline std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, typename AVLTree<T, Allocator, Comparator>::iterator_type>
+        AVLTree<T, Allocator, Comparator>::equal_range(const value_type& value) const
     {
+        return std::make_pair(lower_bound(value), upper_bound(value));
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::floor(const value_type& value) const
+    {
+        s32 result = -1;
+        s32 node = root_;
+        while(0 <= node){
+            s32 cmp = comparator_(nodes_[node].value_, value);
+            if(0 == cmp){
+                return node;
+            }else if(cmp<0){
+                result = node;
+                node = nodes_[node].right_;
+            }else{
+                node = nodes_[node].left_;
+            }
+        }
+        return result;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::ceiling(const value_type& value) const
+    {
+        return lower_bound(value);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Predicate>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::descend(Predicate predicate) const
+    {
+        s32 result = -1;
+        s32 node = root_;
+        while(0 <= node){
+            if(predicate(nodes_[node].value_)){
+                result = node;
+                node = nodes_[node].left_;
+            }else{
+                node = nodes_[node].right_;
+            }
+        }
+        return result;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::finger_find(iterator_type from, const value_type& value) const
+    {
+        s32 node = (from<0)? root_ : fingerStart(from, value);
+        while(0 <= node){
+            s32 cmp = comparator_(nodes_[node].value_, value);
+            if(cmp == 0){
+                return node;
+            }else if(cmp<0){
+                node = nodes_[node].right_;
+            }else{
+                node = nodes_[node].left_;
+            }
+        }
+        return node;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator
+        AVLTree<T, Allocator, Comparator>::begin()
+    {
+        return iterator(this, leftmost_);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::const_iterator
+        AVLTree<T, Allocator, Comparator>::begin() const
+    {
+        return const_iterator(this, leftmost_);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator
+        AVLTree<T, Allocator, Comparator>::end()
+    {
+        return iterator(this, -1);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T,Allocator,Comparator>::const_iterator
+        AVLTree<T,Allocator,Comparator>::end() const
+    {
+        return const_iterator(this, -1);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::reverse_iterator
+        AVLTree<T, Allocator, Comparator>::rbegin()
+    {
+        return reverse_iterator(end());
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::const_reverse_iterator
+        AVLTree<T, Allocator, Comparator>::rbegin() const
+    {
+        return const_reverse_iterator(end());
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::reverse_iterator
+        AVLTree<T, Allocator, Comparator>::rend()
+    {
+        return reverse_iterator(begin());
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::const_reverse_iterator
+        AVLTree<T, Allocator, Comparator>::rend() const
+    {
+        return const_reverse_iterator(begin());
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator
+        AVLTree<T, Allocator, Comparator>::to_iterator(iterator_type pos)
+    {
+        return iterator(this, pos);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::const_iterator
+        AVLTree<T, Allocator, Comparator>::to_iterator(iterator_type pos) const
+    {
+        return const_iterator(this, pos);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline const typename AVLTree<T, Allocator, Comparator>::value_type&
+        AVLTree<T, Allocator, Comparator>::get(iterator_type pos) const
+    {
+        return nodes_[pos].value_;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::value_type&
+        AVLTree<T, Allocator, Comparator>::get(iterator_type pos)
+    {
+        return nodes_[pos].value_;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T,Allocator,Comparator>::updateBalance(s32 node)
+    {
+        TASSERT(0 <= node);
+
+        s32 left = nodes_[node].left_;
+        s32 right = nodes_[node].right_;
+        TASSERT(0 <= left);
+        TASSERT(0 <= right);
+
+        if(1 == nodes_[node].balance_){
+            nodes_[left].balance_ = 0;
+            nodes_[right].balance_ = -1;
+
+        }else if( -1 == nodes_[node].balance_){
+            nodes_[left].balance_ = 1;
+            nodes_[right].balance_ = 0;
+
+        }else{
+            nodes_[left].balance_ = 0;
+            nodes_[right].balance_ = 0;
+        }
+        nodes_[node].balance_ = 0;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline void AVLTree<T,Allocator,Comparator>::insert(value_type&& value)
+    {
+        resetPathCache();
+        Step path[MaxLevels];
+        insertInternal(root_, path, 0, tree::move(value));
+    }
+
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::insert(iterator_type hint, value_type&& value)
+    {
+        resetPathCache();
+        Step path[MaxLevels];
+        if(hint<0){
+            return insertInternal(root_, path, 0, tree::move(value));
+        }
+        s32 node = fingerStart(hint, value);
+        s32 level = buildPath(node, path);
+        return insertInternal(node, path, level, tree::move(value));
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class... Args>
+    std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, bool>
+        AVLTree<T, Allocator, Comparator>::emplace(Args&&... args)
+    {
+        resetPathCache();
+        s32 result = construct(tree::forward<Args>(args)...);
+
+        Step path[MaxLevels];
+        s32 level = 0;
+        s32 node;
+        try{
+            node = findInternal(root_, path, level, nodes_[result].value_);
+        }catch(...){
+            destroy(result);
+            throw;
+        }
+        if(0<=node){
+            destroy(result);
+            return std::make_pair(node, false);
+        }
+        attach(result, path, level);
+        return std::make_pair(result, true);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class Key, class... Args>
+    std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, bool>
+        AVLTree<T, Allocator, Comparator>::try_emplace(const Key& key, Args&&... args)
+    {
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 level = 0;
+        s32 node = findInternal(root_, path, level, key);
+        if(0<=node){
+            return std::make_pair(node, false);
+        }
+        s32 result = construct(tree::forward<Args>(args)...);
+        attach(result, path, level);
+        return std::make_pair(result, true);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, bool>
+        AVLTree<T, Allocator, Comparator>::insert_or_assign(value_type&& value)
+    {
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 level = 0;
+        s32 node = findInternal(root_, path, level, value);
+        if(0<=node){
+            nodes_[node].value_ = tree::move(value);
+            return std::make_pair(node, false);
+        }
+        s32 result = create(tree::move(value));
+        attach(result, path, level);
+        return std::make_pair(result, true);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class Key, class Update, class Creator>
+    std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, bool>
+        AVLTree<T, Allocator, Comparator>::upsert(const Key& key, Update update, Creator creator)
+    {
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 level = 0;
+        s32 node = findInternal(root_, path, level, key);
+        if(0<=node){
+            update(nodes_[node].value_);
+            return std::make_pair(node, false);
+        }
+        //The key may refer to a value in the pool, so the creator is called before the pool can grow
+        s32 result = construct(creator(key));
+        attach(result, path, level);
+        return std::make_pair(result, true);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::push_back(value_type&& value)
+    {
+        if(rightmost_<0 || 0<=comparator_(nodes_[rightmost_].value_, value)){
+            return insert(rightmost_, tree::move(value));
+        }
+        resetPathCache();
+        s32 result = create(tree::move(value));
+        s32 node = rightmost_;
+        nodes_[node].right_ = result;
+        nodes_[result].parent_ = node;
+        rightmost_ = result;
+        addSize(1);
+
+        //Every ancestor grows on the right, so only RR rotations can happen on the right spine
+        for(;;){
+            node_type& n = nodes_[node];
+            --n.balance_;
+            if(0 == n.balance_){
+                break;
+            }
+            if(n.balance_<-1){
+                TASSERT(nodes_[n.right_].balance_<0);
+                s32 parent = n.parent_;
+                s32 newNode = rotateLeft(node);
+                nodes_[newNode].balance_ = 0;
+                nodes_[node].balance_ = 0;
+                if(parent<0){
+                    root_ = newNode;
+                }else{
+                    nodes_[parent].right_ = newNode;
+                }
+                break;
+            }
+            node = n.parent_;
+            if(node<0){
+                break;
+            }
+        }
+        return result;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T,Allocator,Comparator>::remove(const value_type& value)
+    {
+        resetPathCache();
         s32 numLevels = 0;
         Step path[MaxLevels];
         s32 n = findInternal(root_, path, numLevels, value);
         if(n<0){
             return;
         }
+        eraseInternal(n, path, numLevels);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::min() const
+    {
+        return leftmost_;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::max() const
+    {
+        return rightmost_;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::erase(iterator_type pos)
+    {
+        TASSERT(0<=pos && pos<nodes_.capacity());
+        resetPathCache();
+        //Nodes are relinked but not relocated by erasing, so the successor stays valid
+        s32 next = successor(pos);
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(pos, path);
+        eraseInternal(pos, path, numLevels);
+        return next;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::value_type
+        AVLTree<T, Allocator, Comparator>::extract(iterator_type pos)
+    {
+        TASSERT(0<=pos && pos<nodes_.capacity());
+        resetPathCache();
+        value_type value(tree::move(nodes_[pos].value_));
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(pos, path);
+        eraseInternal(pos, path, numLevels);
+        return value;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::erase_range(const value_type& lower, const value_type& upper)
+    {
+        if(root_<0 || 0<=comparator_(lower, upper)){
+            return 0;
+        }
+        resetPathCache();
+
+        //Split into [, lower), [lower, upper) and [upper, ), the equivalent nodes are split off separately
+        s32 left, leftHeight, rest, restHeight;
+        s32 first = splitInternal(root_, height(root_), lower, left, leftHeight, rest, restHeight);
+        s32 range, rangeHeight, right, rightHeight;
+        s32 last = splitInternal(rest, restHeight, upper, range, rangeHeight, right, rightHeight);
+        s32 removed = clearInternal(range);
+        if(0<=first){
+            destroy(first);
+            ++removed;
+        }
+
+        s32 h;
+        if(0<=last){
+            root_ = joinInternal(left, leftHeight, last, right, rightHeight, h);
+        }else{
+            root_ = join2Internal(left, leftHeight, right, rightHeight, h);
+        }
+        if(0<=root_){
+            nodes_[root_].parent_ = -1;
+        }
+        addSize(-removed);
+        updateEnds();
+        return removed;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::node_handle
+        AVLTree<T, Allocator, Comparator>::extract_node(iterator_type pos)
+    {
+        TASSERT(0<=pos && pos<nodes_.capacity());
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(pos, path);
+        detach(pos, path, numLevels);
+        return node_handle(this, pos);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    std::pair<typename AVLTree<T, Allocator, Comparator>::iterator_type, bool>
+        AVLTree<T, Allocator, Comparator>::insert(node_handle&& handle)
+    {
+        if(handle.empty()){
+            return std::make_pair(end(), false);
+        }
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 level = 0;
+        s32 node = findInternal(root_, path, level, handle.value());
+        if(0<=node){
+            return std::make_pair(node, false);
+        }
+        s32 result;
+        if(this == handle.tree_){
+            result = handle.node_;
+            --handles_;
+        }else{
+            result = allocate();
+            TPLACEMENT_NEW(&nodes_[result].value_) value_type(tree::move(handle.value()));
+            handle.release();
+        }
+        handle.tree_ = NULL;
+        handle.node_ = -1;
+        attach(result, path, level);
+        return std::make_pair(result, true);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::pop_min()
+    {
+        if(leftmost_<0){
+            return;
+        }
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(leftmost_, path);
+        eraseInternal(leftmost_, path, numLevels);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::pop_max()
+    {
+        if(rightmost_<0){
+            return;
+        }
+        resetPathCache();
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(rightmost_, path);
+        eraseInternal(rightmost_, path, numLevels);
+    }
+
+    /**
+    Remove the node n, path holds the ancestors of n
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::eraseInternal(s32 n, Step* path, s32 numLevels)
+    {
+        detach(n, path, numLevels);
+        destroy(n);
+    }
+
+    /**
+    Unlink the node n and rebalance, the value of n stays alive
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::detach(s32 n, Step* path, s32 numLevels)
+    {
+        node_type& node = nodes_[n];
+        s32 left = node.left_;
+        s32 right = node.right_;
+        if(n == leftmost_){
+            //The successor is the leftmost of the right subtree, or the parent
+            if(0<=right){
+                leftmost_ = right;
+                while(0<=nodes_[leftmost_].left_){
+                    leftmost_ = nodes_[leftmost_].left_;
+                }
+            }else{
+                leftmost_ = node.parent_;
+            }
+        }
+        if(n == rightmost_){
+            //The predecessor is the rightmost of the left subtree, or the parent
+            if(0<=left){
+                rightmost_ = left;
+                while(0<=nodes_[rightmost_].right_){
+                    rightmost_ = nodes_[rightmost_].right_;
+                }
+            }else{
+                rightmost_ = node.parent_;
+            }
+        }
+
+        if(right<0){
+            if(0 < numLevels) {
+                nodes_[path[numLevels-1].node_].getSub(path[numLevels-1].which_) = left;
+            } else{
+                root_ = left;
+            }
+            if(0<=left){
+                nodes_[left].parent_ = node.parent_;
+            }
+
+        }else{
+            if(nodes_[right].left_<0){
+                nodes_[right].left_ = node.left_;
+                nodes_[right].balance_ = node.balance_;
+                nodes_[right].parent_ = node.parent_;
+                if(0<=node.left_){
+                    nodes_[node.left_].parent_ = right;
+                }
+
+                if(0 < numLevels) {
+                    nodes_[path[numLevels-1].node_].getSub(path[numLevels-1].which_) = right;
+                } else{
+                    root_ = right;
+                }
+
+
+                TASSERT(numLevels<MaxLevels);
+                path[numLevels].node_ = right;
+                path[numLevels].which_ = AVLSub_Right;
+                ++numLevels;
+
+            }else{
+                s32 l = numLevels++;
+                for(;;){
+                    TASSERT(numLevels<MaxLevels);
+                    path[numLevels].which_ = AVLSub_Left;
+                    path[numLevels].node_ = right;
+                    ++numLevels;
+                    left = nodes_[right].left_;
+                    if(nodes_[left].left_<0){
+                        break;
+                    }
+                    right = left;
+                }
+                nodes_[left].left_ = node.left_;
+                nodes_[right].left_ = nodes_[left].right_;
+                if(0<=node.left_){
+                    nodes_[node.left_].parent_ = left;
+                }
+                if(0<=nodes_[left].right_){
+                    nodes_[nodes_[left].right_].parent_ = right;
+                }
+
+                nodes_[left].right_ = node.right_;
+                nodes_[left].balance_ = node.balance_;
+                nodes_[left].parent_ = node.parent_;
+                nodes_[node.right_].parent_ = left;
+
+                if(0 < l) {
+                    nodes_[path[l - 1].node_].getSub(path[l - 1].which_) = left;
+                } else{
+                    root_ = left;
+                }
+                path[l].which_ = AVLSub_Right;
+                path[l].node_ = left;
+            }
+        }
+        node.balance_ = 0;
+        node.parent_ = -1;
+        node.left_ = -1;
+        node.right_ = -1;
+        balanceRemove(path, numLevels);
+        addSize(-1);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T,Allocator,Comparator>::build_from_sorted(value_type* values, s32 count)
+    {
+        TASSERT(0<=count);
+        TASSERT(0 == handles_);
+        clear();
+        if(count<=0){
+            return;
+        }
+#ifndef NDEBUG
+        for(s32 i=1; i<count; ++i){
+            TASSERT(comparator_(values[i-1], values[i])<0);
+        }
+#endif
+
+        if(!ownsPool()){
+            //The other trees have nodes in the pool, so the nodes are taken from the free list
+            root_ = buildInternal(values, count, -1);
+            size_ = count;
+            updateEnds();
+            return;
+        }
+
+        //All values are destroyed, so the nodes are reallocated to the exact count without moves
+        acquirePool();
+        NodePool* pool = nodes_.pool_;
+        if(pool->capacity_<count){
+            node_type* items = allocateNodes(count);
+            allocator_.free(pool->items_);
+            pool->items_ = items;
+            pool->capacity_ = count;
+        }
+        for(s32 i=count; i<pool->capacity_; ++i){
+            nodes_[i].balance_ = i+1;
+        }
+        nodes_[pool->capacity_-1].balance_ = -1;
+        pool->empty_ = (count<pool->capacity_)? count : -1;
+
+        //Visit the nodes in breadth first order, a node holds the range of its subtree in left_ and right_ until visited
+        node_type* nodes = pool->items_;
+        nodes[0].parent_ = -1;
+        nodes[0].left_ = 0;
+        nodes[0].right_ = count;
+        s32 next = 1;
+        for(s32 i=0; i<count; ++i){
+            node_type& node = nodes[i];
+            s32 begin = node.left_;
+            s32 end = node.right_;
+            s32 numLeft = (end-begin)>>1;
+            s32 numRight = end-begin-1-numLeft;
+            s32 middle = begin + numLeft;
+            TPLACEMENT_NEW(&node.value_) value_type(tree::move(values[middle]));
+
+            //numLeft is numRight or numRight+1, the left is higher only if numLeft is a power of 2
+            node.balance_ = (numLeft != numRight && 0 == (numLeft&(numLeft-1)))? 1 : 0;
+            node.left_ = -1;
+            node.right_ = -1;
+            if(0<numLeft){
+                node.left_ = next;
+                nodes[next].parent_ = i;
+                nodes[next].left_ = begin;
+                nodes[next].right_ = middle;
+                ++next;
+            }
+            if(0<numRight){
+                node.right_ = next;
+                nodes[next].parent_ = i;
+                nodes[next].left_ = middle+1;
+                nodes[next].right_ = end;
+                ++next;
+            }
+            if(0 == middle){
+                leftmost_ = i;
+            }
+            if(count-1 == middle){
+                rightmost_ = i;
+            }
+        }
+        TASSERT(next == count);
+        root_ = 0;
+        size_ = count;
+    }
+
+    /**
+    Build the subtree of the sorted values with the nodes from the free list, returns the root
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T,Allocator,Comparator>::buildInternal(value_type* values, s32 count, s32 parent)
+    {
+        if(count<=0){
+            return -1;
+        }
+        s32 numLeft = count>>1;
+        s32 numRight = count-1-numLeft;
+        s32 node = create(tree::move(values[numLeft]));
+        nodes_[node].parent_ = parent;
+        //The same shape as build_from_sorted
+        nodes_[node].balance_ = (numLeft != numRight && 0 == (numLeft&(numLeft-1)))? 1 : 0;
+        s32 left = buildInternal(values, numLeft, node);
+        nodes_[node].left_ = left;
+        s32 right = buildInternal(values+numLeft+1, numRight, node);
+        nodes_[node].right_ = right;
+        return node;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T,Allocator,Comparator>::insert_batch(value_type* values, s32 count)
+    {
+        TASSERT(0<=count);
+        TASSERT(0 == handles_);
+        count = sortUnique(values, count);
+        if(count<=0){
+            return 0;
+        }
+        s32 inserted = 0;
+        if(static_cast<s64>(count)*BatchMergeRatio < size()){
+            s32 hint = -1;
+            for(s32 i=0; i<count; ++i){
+                s32 size = size_;
+                hint = insert(hint, tree::move(values[i]));
+                inserted += size_-size;
+            }
+            return inserted;
+        }
+
+        //Move the values of the tree and the batch into a buffer in order, then rebuild
+        value_type* merged = allocator_.template malloc<value_type>(sizeof(value_type)*(static_cast<size_t>(size_)+static_cast<size_t>(count)));
+        s32 numMerged = 0;
+        s32 node = leftmost_;
+        s32 i = 0;
+        while(0<=node){
+            s32 cmp = (i<count)? comparator_(nodes_[node].value_, values[i]) : -1;
+            if(0<cmp){
+                TPLACEMENT_NEW(&merged[numMerged++]) value_type(tree::move(values[i]));
+                ++inserted;
+                ++i;
+                continue;
+            }
+            if(0 == cmp){
+                //Keep the value in the tree
+                ++i;
+            }
+            TPLACEMENT_NEW(&merged[numMerged++]) value_type(tree::move(nodes_[node].value_));
+            node = successor(node);
+        }
+        for(; i<count; ++i){
+            TPLACEMENT_NEW(&merged[numMerged++]) value_type(tree::move(values[i]));
+            ++inserted;
+        }
+        build_from_sorted(merged, numMerged);
+        for(s32 j=0; j<numMerged; ++j){
+            merged[j].~T();
+        }
+        allocator_.free(merged);
+        return inserted;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T,Allocator,Comparator>::remove_batch(value_type* values, s32 count)
+    {
+        TASSERT(0<=count);
+        TASSERT(0 == handles_);
+        count = sortUnique(values, count);
+        if(count<=0 || root_<0){
+            return 0;
+        }
+        s32 removed = 0;
+        if(static_cast<s64>(count)*BatchMergeRatio < size()){
+            s32 finger = -1;
+            for(s32 i=0; i<count; ++i){
+                s32 node = finger_find(finger, values[i]);
+                if(0<=node){
+                    //The successor is not greater than the next value, so it stays a good finger
+                    finger = erase(node);
+                    ++removed;
+                }
+            }
+            return removed;
+        }
+
+        //Move the remaining values of the tree into a buffer in order, then rebuild
+        value_type* remaining = allocator_.template malloc<value_type>(sizeof(value_type)*size_);
+        s32 numRemaining = 0;
+        s32 i = 0;
+        for(s32 node = leftmost_; 0<=node; node = successor(node)){
+            s32 cmp = -1;
+            while(i<count && 0<(cmp = comparator_(nodes_[node].value_, values[i]))){
+                ++i;
+            }
+            if(i<count && 0 == cmp){
+                ++removed;
+                ++i;
+                continue;
+            }
+            TPLACEMENT_NEW(&remaining[numRemaining++]) value_type(tree::move(nodes_[node].value_));
+        }
+        build_from_sorted(remaining, numRemaining);
+        for(s32 j=0; j<numRemaining; ++j){
+            remaining[j].~T();
+        }
+        allocator_.free(remaining);
+        return removed;
+    }
+
+    /**
+    Sort the values and move the unique ones to the front, returns the number of the unique values
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T,Allocator,Comparator>::sortUnique(value_type* values, s32 count) const
+    {
+        if(count<=1){
+            return count;
+        }
+        const comparator_type& comparator = comparator_;
+        std::sort(values, values+count, [&comparator](const value_type& v0, const value_type& v1){
+            return comparator(v0, v1)<0;
+        });
+        value_type* end = std::unique(values, values+count, [&comparator](const value_type& v0, const value_type& v1){
+            return 0 == comparator(v0, v1);
+        });
+        return static_cast<s32>(end-values);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T,Allocator,Comparator>::clear()
+    {
+        resetPathCache();
+        clearInternal(root_);
+        root_ = -1;
+        leftmost_ = -1;
+        rightmost_ = -1;
+        size_ = 0;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::swap(AVLTree& rhs)
+    {
+        //The handles refer to the trees, not to the pools
+        TASSERT(0 == handles_ && 0 == rhs.handles_);
+        tree::swap(size_, rhs.size_);
+        tree::swap(nodes_.pool_, rhs.nodes_.pool_);
+        tree::swap(cache_, rhs.cache_);
+        tree::swap(root_, rhs.root_);
+        tree::swap(leftmost_, rhs.leftmost_);
+        tree::swap(rightmost_, rhs.rightmost_);
+        tree::swap(allocator_, rhs.allocator_);
+        tree::swap(comparator_, rhs.comparator_);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::share_pool(AVLTree& other)
+    {
+        TASSERT(0 == handles_);
+        if(this == &other || shares_pool(other)){
+            return;
+        }
+        clear();
+        other.acquirePool();
+        releasePool();
+        nodes_.pool_ = other.nodes_.pool_;
+        ++nodes_.pool_->references_;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline bool AVLTree<T, Allocator, Comparator>::shares_pool(const AVLTree& other) const
+    {
+        return NULL != nodes_.pool_ && nodes_.pool_ == other.nodes_.pool_;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::split(const value_type& key, AVLTree& right)
+    {
+        TASSERT(this != &right);
+        TASSERT(0 == handles_ && 0 == right.handles_);
+        resetPathCache();
+        right.clear();
+        if(root_<0){
+            return;
+        }
+        s32 left, leftHeight, rightRoot, rightHeight;
+        s32 middle = splitInternal(root_, height(root_), key, left, leftHeight, rightRoot, rightHeight);
+        if(0<=middle){
+            rightRoot = joinInternal(-1, 0, middle, rightRoot, rightHeight, rightHeight);
+        }
+        if(0<=left){
+            nodes_[left].parent_ = -1;
+        }
+        if(0<=rightRoot){
+            nodes_[rightRoot].parent_ = -1;
+        }
+
+        s32 count = 0;
+        if(shares_pool(right)){
+            //Both parts stay in place, the sizes are counted later unless a part is empty
+            s32 size = size_;
+            root_ = left;
+            size_ = (rightRoot<0)? size : (left<0)? 0 : -1;
+            right.root_ = rightRoot;
+            right.size_ = (left<0)? size : (rightRoot<0)? 0 : -1;
+        }else if(leftHeight<rightHeight && ownsPool() && right.ownsPool()){
+            //Give the nodes to right, and take the lower part back
+            s32 size = size_;
+            swap(right);
+            root_ = transplant(right, left, -1, count);
+            size_ = count;
+            right.root_ = rightRoot;
+            right.size_ = (0<=size)? size - count : -1;
+        }else{
+            right.root_ = right.transplant(*this, rightRoot, -1, count);
+            right.size_ = count;
+            root_ = left;
+            addSize(-count);
+        }
+        updateEnds();
+        right.updateEnds();
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::join(AVLTree& right)
+    {
+        TASSERT(this != &right);
+        TASSERT(0 == handles_ && 0 == right.handles_);
+        if(right.root_<0){
+            return;
+        }
+        resetPathCache();
+        right.resetPathCache();
+        bool shared = shares_pool(right);
+        //The pools are not exchanged if either of them is shared with another tree
+        bool swappable = !shared && ownsPool() && right.ownsPool();
+        if(root_<0 && swappable){
+            swap(right);
+            return;
+        }
+        TASSERT(root_<0 || comparator_(nodes_[rightmost_].value_, right.nodes_[right.leftmost_].value_)<0);
+
+        s32 total = (0<=size_ && 0<=right.size_)? size_ + right.size_ : -1;
+        bool upper = height(root_)<right.height(right.root_);
+        bool swapped = upper && swappable;
+        if(swapped){
+            //Keep the nodes of the higher tree
+            swap(right);
+        }
+        s32 count = 0;
+        s32 other = shared? right.root_ : transplant(right, right.root_, -1, count);
+        right.root_ = -1;
+        right.leftmost_ = -1;
+        right.rightmost_ = -1;
+        right.size_ = 0;
+
+        //Take the least value of the upper part as the middle
+        s32 lower = swapped? other : root_;
+        root_ = swapped? root_ : other;
+        leftmost_ = root_;
+        while(0<=nodes_[leftmost_].left_){
+            leftmost_ = nodes_[leftmost_].left_;
+        }
+        s32 middle = leftmost_;
+        Step path[MaxLevels];
+        s32 numLevels = buildPath(middle, path);
+        detach(middle, path, numLevels);
+
+        s32 h;
+        root_ = joinInternal(lower, height(lower), middle, root_, height(root_), h);
+        nodes_[root_].parent_ = -1;
+        size_ = total;
+        updateEnds();
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_union(AVLTree& other)
+    {
+        unionTrees(other, SequentialFork());
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_intersection(AVLTree& other)
+    {
+        intersectTrees(other, SequentialFork());
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_difference(AVLTree& other)
+    {
+        differenceTrees(other, SequentialFork());
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_union(const AVLTree& other, AVLTree& result) const
+    {
+        copySetOperation(other, result, SetOperation_Union);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_intersection(const AVLTree& other, AVLTree& result) const
+    {
+        copySetOperation(other, result, SetOperation_Intersection);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::set_difference(const AVLTree& other, AVLTree& result) const
+    {
+        copySetOperation(other, result, SetOperation_Difference);
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Copy the values of the result into a buffer in order, then rebuild result
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::copySetOperation(const AVLTree& other, AVLTree& result, SetOperation operation) const
+    {
+        TASSERT(&result != this && &result != &other);
+        //Count the sizes, if a split or a join in a shared pool left them uncounted
+        size();
+        other.size();
+        bool search = (SetOperation_Intersection == operation) || (SetOperation_Difference == operation && size_<=other.size_);
+        size_t capacity = static_cast<size_t>(size_);
+        if(SetOperation_Union == operation){
+            capacity += static_cast<size_t>(other.size_);
+        }else if(SetOperation_Intersection == operation && other.size_<size_){
+            capacity = static_cast<size_t>(other.size_);
+        }
+        if(capacity<=0){
+            result.clear();
+            return;
+        }
+        value_type* values = result.allocator_.template malloc<value_type>(sizeof(value_type)*capacity);
+        s32 count = 0;
+        if(search){
+            //Iterate the smaller tree, and search the larger one from the previous match
+            bool overThis = (size_<=other.size_);
+            const AVLTree& smaller = overThis? *this : other;
+            const AVLTree& larger = overThis? other : *this;
+            s32 finger = -1;
+            for(s32 node = smaller.leftmost_; 0<=node; node = smaller.successor(node)){
+                s32 found = larger.finger_find(finger, smaller.nodes_[node].value_);
+                if(0<=found){
+                    finger = found;
+                }
+                if(SetOperation_Intersection == operation){
+                    if(0<=found){
+                        TPLACEMENT_NEW(&values[count++]) value_type(overThis? nodes_[node].value_ : nodes_[found].value_);
+                    }
+                }else if(found<0){
+                    TPLACEMENT_NEW(&values[count++]) value_type(nodes_[node].value_);
+                }
+            }
+        }else{
+            //The union, or the difference from the larger tree
+            s32 node = leftmost_;
+            s32 otherNode = other.leftmost_;
+            while(0<=node || (SetOperation_Union == operation && 0<=otherNode)){
+                s32 cmp = (node<0)? 1 : (otherNode<0)? -1 : comparator_(nodes_[node].value_, other.nodes_[otherNode].value_);
+                if(cmp<0){
+                    TPLACEMENT_NEW(&values[count++]) value_type(nodes_[node].value_);
+                    node = successor(node);
+                }else if(0<cmp){
+                    if(SetOperation_Union == operation){
+                        TPLACEMENT_NEW(&values[count++]) value_type(other.nodes_[otherNode].value_);
+                    }
+                    otherNode = other.successor(otherNode);
+                }else{
+                    if(SetOperation_Union == operation){
+                        TPLACEMENT_NEW(&values[count++]) value_type(nodes_[node].value_);
+                    }
+                    node = successor(node);
+                    otherNode = other.successor(otherNode);
+                }
+            }
+        }
+        result.build_from_sorted(values, count);
+        for(s32 i=0; i<count; ++i){
+            values[i].~T();
+        }
+        result.allocator_.free(values);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool>
+    void AVLTree<T, Allocator, Comparator>::parallel_set_union(Pool& pool, AVLTree& other)
+    {
+        //The nodes of other are moved into this tree's pool before the recursion
+        ParallelFork<Pool> fork = {&pool, this, this};
+        unionTrees(other, fork);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool>
+    void AVLTree<T, Allocator, Comparator>::parallel_set_intersection(Pool& pool, AVLTree& other)
+    {
+        ParallelFork<Pool> fork = {&pool, this, &other};
+        intersectTrees(other, fork);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool>
+    void AVLTree<T, Allocator, Comparator>::parallel_set_difference(Pool& pool, AVLTree& other)
+    {
+        ParallelFork<Pool> fork = {&pool, this, &other};
+        differenceTrees(other, fork);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool>
+    s32 AVLTree<T, Allocator, Comparator>::parallel_insert_batch(Pool& pool, value_type* values, s32 count)
+    {
+        TASSERT(0<=count);
+        count = sortUnique(values, count);
+        if(count<=0){
+            return 0;
+        }
+        this_type batch;
+        batch.build_from_sorted(values, count);
+        ParallelFork<Pool> fork = {&pool, this, this};
+        //The values of the batch equivalent to the ones of the tree are not inserted
+        return count - unionTrees(batch, fork);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool>
+    s32 AVLTree<T, Allocator, Comparator>::parallel_remove_batch(Pool& pool, value_type* values, s32 count)
+    {
+        TASSERT(0<=count);
+        count = sortUnique(values, count);
+        if(count<=0 || root_<0){
+            return 0;
+        }
+        resetPathCache();
+        ParallelFork<Pool> fork = {&pool, this, this};
+        SetState state;
+        initState(state);
+        s32 h;
+        root_ = differenceRange(root_, height(root_), values, count, fork, state, h);
+        if(0<=root_){
+            nodes_[root_].parent_ = -1;
+        }
+        reclaim(state.released_);
+        addSize(-state.matches_);
+        updateEnds();
+        return state.matches_;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<s32 Order, class Visitor>
+    inline bool AVLTree<T, Allocator, Comparator>::traverse(Visitor& visitor)
+    {
+        return traverseInternal<Order>(nodes_.items(), root_, visitor);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<s32 Order, class Visitor>
+    inline bool AVLTree<T, Allocator, Comparator>::traverse(Visitor& visitor) const
+    {
+        return traverseInternal<Order>(static_cast<const node_type*>(nodes_.items()), root_, visitor);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<s32 Order, class Node, class Visitor>
+    bool AVLTree<T, Allocator, Comparator>::traverseInternal(Node* nodes, s32 root, Visitor& visitor)
+    {
+        typedef TraversalInvoker<decltype(visitor(nodes[0].value_))> invoker_type;
+
+        s32 stack[MaxLevels];
+        s32 top = 0;
+        s32 node = root;
+        switch(Order)
+        {
+        case TraversalOrder_InOrder:
+            while(0<=node || 0<top){
+                if(0<=node){
+                    TASSERT(top<MaxLevels);
+                    stack[top++] = node;
+                    node = nodes[node].left_;
+                }else{
+                    node = stack[--top];
+                    if(!invoker_type::invoke(visitor, nodes[node].value_)){
+                        return false;
+                    }
+                    node = nodes[node].right_;
+                }
+            }
+            break;
+
+        case TraversalOrder_PreOrder:
+            //Keep pending right subtrees
+            while(0<=node){
+                if(!invoker_type::invoke(visitor, nodes[node].value_)){
+                    return false;
+                }
+                if(0<=nodes[node].right_){
+                    TASSERT(top<MaxLevels);
+                    stack[top++] = nodes[node].right_;
+                }
+                node = nodes[node].left_;
+                if(node<0 && 0<top){
+                    node = stack[--top];
+                }
+            }
+            break;
+
+        case TraversalOrder_PostOrder:
+        {
+            s32 last = -1;
+            while(0<=node || 0<top){
+                if(0<=node){
+                    TASSERT(top<MaxLevels);
+                    stack[top++] = node;
+                    node = nodes[node].left_;
+                }else{
+                    s32 right = nodes[stack[top-1]].right_;
+                    if(0<=right && last != right){
+                        node = right;
+                    }else{
+                        last = stack[--top];
+                        if(!invoker_type::invoke(visitor, nodes[last].value_)){
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+            break;
+
+        default:
+            TASSERT(false);
+            break;
+        }
+        return true;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Visitor>
+    inline bool AVLTree<T, Allocator, Comparator>::scan(const value_type& lower, const value_type& upper, Visitor& visitor)
+    {
+        return scanInternal(nodes_.items(), lower, &upper, visitor);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class Visitor>
+    inline bool AVLTree<T, Allocator, Comparator>::scan(const value_type& lower, const value_type& upper, Visitor& visitor) const
+    {
+        return scanInternal(static_cast<const node_type*>(nodes_.items()), lower, &upper, visitor);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class Visitor>
+    bool AVLTree<T, Allocator, Comparator>::prefix_scan(const value_type& prefix, Visitor& visitor)
+    {
+        value_type upper;
+        bool bounded = prefix_upper_bound(upper, prefix);
+        return scanInternal(nodes_.items(), prefix, bounded? &upper : NULL, visitor);
+    }
+
+    template<class T, class Allocator, class Comparator>
+    template<class Visitor>
+    bool AVLTree<T, Allocator, Comparator>::prefix_scan(const value_type& prefix, Visitor& visitor) const
+    {
+        value_type upper;
+        bool bounded = prefix_upper_bound(upper, prefix);
+        return scanInternal(static_cast<const node_type*>(nodes_.items()), prefix, bounded? &upper : NULL, visitor);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Node, class Visitor>
+    bool AVLTree<T, Allocator, Comparator>::scanInternal(Node* nodes, const value_type& lower, const value_type* upper, Visitor& visitor) const
+    {
+        typedef TraversalInvoker<decltype(visitor(nodes[0].value_))> invoker_type;
+
+        //Descend to the lower bound, keep the ancestors not less than it
+        s32 stack[MaxLevels];
+        s32 top = 0;
+        s32 node = root_;
+        while(0<=node){
+            if(0<=comparator_(nodes[node].value_, lower)){
+                TASSERT(top<MaxLevels);
+                stack[top++] = node;
+                node = nodes[node].left_;
+            }else{
+                node = nodes[node].right_;
+            }
+        }
+
+        //Walk in order until the upper bound, right subtrees are not less than the lower bound
+        while(0<top){
+            node = stack[--top];
+            if(NULL != upper && 0<=comparator_(nodes[node].value_, *upper)){
+                break;
+            }
+            if(!invoker_type::invoke(visitor, nodes[node].value_)){
+                return false;
+            }
+            for(node = nodes[node].right_; 0<=node; node = nodes[node].left_){
+                TASSERT(top<MaxLevels);
+                stack[top++] = node;
+            }
+        }
+        return true;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool, class Visitor>
+    void AVLTree<T, Allocator, Comparator>::parallel_for_each(Pool& pool, Visitor& visitor)
+    {
+        typedef TraversalInvoker<decltype(visitor(nodes_[0].value_))> invoker_type;
+
+        ParallelItem items[2<<MaxParallelLevels];
+        s32 levels = parallelLevels(pool.size()*4);
+        s32 count = gatherParallelItems(root_, 0, levels, items, 0);
+
+        node_type* nodes = nodes_.items();
+        typename Pool::TaskGroup group;
+        for(s32 i=0; i<count; ++i){
+            if(items[i].subtree_){
+                s32 node = items[i].node_;
+                pool.spawn(group, [nodes, node, &visitor]{
+                    traverseInternal<TraversalOrder_InOrder>(nodes, node, visitor);
+                });
+            }
+        }
+        for(s32 i=0; i<count; ++i){
+            if(!items[i].subtree_){
+                invoker_type::invoke(visitor, nodes[items[i].node_].value_);
+            }
+        }
+        pool.wait(group);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Pool, class Visitor>
+    s32 AVLTree<T, Allocator, Comparator>::parallel_for_each_ordered(Pool& pool, const Visitor& visitor, Visitor* chunks, s32 maxChunks)
+    {
+        TASSERT(0<maxChunks);
+        ParallelItem items[2<<MaxParallelLevels];
+        s32 starts[(1<<MaxParallelLevels)+1];
+
+        //Each chunk starts at a subtree, and continues with the following nodes
+        s32 levels = parallelLevels(maxChunks+1)-1;
+        s32 count = gatherParallelItems(root_, 0, levels, items, 0);
+        s32 numChunks = 0;
+        starts[numChunks++] = 0;
+        bool first = true;
+        for(s32 i=0; i<count; ++i){
+            if(items[i].subtree_){
+                if(!first){
+                    starts[numChunks++] = i;
+                }
+                first = false;
+            }
+        }
+        starts[numChunks] = count;
+        TASSERT(numChunks<=maxChunks);
+
+        node_type* nodes = nodes_.items();
+        typename Pool::TaskGroup group;
+        for(s32 i=0; i<numChunks; ++i){
+            chunks[i] = visitor;
+            Visitor* chunk = &chunks[i];
+            const ParallelItem* begin = items + starts[i];
+            const ParallelItem* end = items + starts[i+1];
+            pool.spawn(group, [nodes, begin, end, chunk]{
+                typedef TraversalInvoker<decltype((*chunk)(nodes[0].value_))> invoker_type;
+                for(const ParallelItem* item = begin; item != end; ++item){
+                    if(item->subtree_){
+                        traverseInternal<TraversalOrder_InOrder>(nodes, item->node_, *chunk);
+                    }else{
+                        invoker_type::invoke(*chunk, nodes[item->node_].value_);
+                    }
+                }
+            });
+        }
+        pool.wait(group);
+        return numChunks;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::partition(const value_type& lower, const value_type& upper, s32 count, iterator_type* bounds) const
+    {
+        TASSERT(0<count);
+        bounds[0] = lower_bound(lower);
+        s32 end = lower_bound(upper);
+        if(bounds[0] == end || (0<=end && 0<=comparator_(nodes_[bounds[0]].value_, nodes_[end].value_))){
+            return 0;
+        }
+
+        //The highest node in the range, the subtree contains the whole range
+        s32 top = root_;
+        for(;;){
+            if(comparator_(nodes_[top].value_, lower)<0){
+                top = nodes_[top].right_;
+            }else if(0<=comparator_(nodes_[top].value_, upper)){
+                top = nodes_[top].left_;
+            }else{
+                break;
+            }
+        }
+
+        //Sample the range with several times more nodes than sub-ranges, the sampled levels get deeper if the range is narrow
+        PartitionItem items[2<<MaxParallelLevels];
+        s32 numItems = 0;
+        s32 numNodes = 0;
+        for(s32 levels = parallelLevels(count*8); ; ++levels){
+            numItems = gatherPartitionItems(top, 0, levels, lower, upper, items, 0);
+            numNodes = 0;
+            for(s32 i=0; i<numItems; ++i){
+                numNodes += (0<items[i].weight_)? 0 : 1;
+            }
+            if(count*4<=numNodes || numNodes == numItems || MaxParallelLevels<=levels){
+                break;
+            }
+        }
+        s64 total = 0;
+        for(s32 i=0; i<numItems; ++i){
+            total += (0<items[i].weight_)? items[i].weight_ : 1;
+        }
+
+        s32 n = 1;
+        s64 sum = 0;
+        for(s32 i=0; i<numItems && n<count; ++i){
+            if(0<items[i].weight_){
+                sum += items[i].weight_;
+                continue;
+            }
+            if(total*n<=sum*count && 0<comparator_(nodes_[items[i].node_].value_, nodes_[bounds[n-1]].value_)){
+                bounds[n++] = items[i].node_;
+            }
+            sum += 1;
+        }
+        bounds[n] = end;
+        return n;
+    }
 
-        node_type& node = nodes_[n];
-        s32 left = node.left_;
-        s32 right = node.right_;
+    //---------------------------------------------------------------
+    /**
+    Gather in order the nodes in the range above the level, and the subtrees at the level
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::gatherPartitionItems(s32 node, s32 level, s32 levels, const value_type& lower, const value_type& upper, PartitionItem* items, s32 count) const
+    {
+        if(node<0){
+            return count;
+        }
+        if(levels<=level){
+            s32 h = height(node);
+            items[count].node_ = node;
+            items[count].weight_ = (h<31)? (1<<(h-1)) : (1<<30);
+            return count+1;
+        }
+        if(comparator_(nodes_[node].value_, lower)<0){
+            return gatherPartitionItems(nodes_[node].right_, level+1, levels, lower, upper, items, count);
+        }
+        if(0<=comparator_(nodes_[node].value_, upper)){
+            return gatherPartitionItems(nodes_[node].left_, level+1, levels, lower, upper, items, count);
+        }
+        count = gatherPartitionItems(nodes_[node].left_, level+1, levels, lower, upper, items, count);
+        items[count].node_ = node;
+        items[count].weight_ = 0;
+        ++count;
+        return gatherPartitionItems(nodes_[node].right_, level+1, levels, lower, upper, items, count);
+    }
 
-        if(right<0){
-            if(0 < numLevels) {
-                nodes_[path[numLevels-1].node_].getSub(path[numLevels-1].which_) = left;
-            } else{
-                root_ = left;
+    //---------------------------------------------------------------
+    /**
+    Height of the subtree, following the taller children
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::height(s32 node) const
+    {
+        s32 h = 0;
+        while(0<=node){
+            ++h;
+            node = (nodes_[node].balance_<0)? nodes_[node].right_ : nodes_[node].left_;
+        }
+        return h;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    inline void AVLTree<T, Allocator, Comparator>::childHeights(s32 node, s32 height, s32& leftHeight, s32& rightHeight) const
+    {
+        s32 balance = nodes_[node].balance_;
+        if(0<=balance){
+            leftHeight = height-1;
+            rightHeight = leftHeight-balance;
+        }else{
+            rightHeight = height-1;
+            leftHeight = rightHeight+balance;
+        }
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Join the subtrees left and right with the node middle between them, their values are ordered.
+    Descends the spine of the higher subtree, so costs O(|leftHeight-rightHeight|)
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::joinInternal(s32 left, s32 leftHeight, s32 middle, s32 right, s32 rightHeight, s32& height)
+    {
+        if(rightHeight+1<leftHeight){
+            s32 leftLeft, leftRight;
+            childHeights(left, leftHeight, leftLeft, leftRight);
+            s32 h;
+            s32 sub = joinInternal(nodes_[left].right_, leftRight, middle, right, rightHeight, h);
+            nodes_[left].right_ = sub;
+            nodes_[sub].parent_ = left;
+            return rebalanceJoin(left, leftLeft, h, height);
+        }
+        if(leftHeight+1<rightHeight){
+            s32 rightLeft, rightRight;
+            childHeights(right, rightHeight, rightLeft, rightRight);
+            s32 h;
+            s32 sub = joinInternal(left, leftHeight, middle, nodes_[right].left_, rightLeft, h);
+            nodes_[right].left_ = sub;
+            nodes_[sub].parent_ = right;
+            return rebalanceJoin(right, h, rightRight, height);
+        }
+        node_type& n = nodes_[middle];
+        n.left_ = left;
+        n.right_ = right;
+        n.parent_ = -1;
+        n.balance_ = leftHeight-rightHeight;
+        if(0<=left){
+            nodes_[left].parent_ = middle;
+        }
+        if(0<=right){
+            nodes_[right].parent_ = middle;
+        }
+        height = ((leftHeight<rightHeight)? rightHeight : leftHeight) + 1;
+        return middle;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Restore the balance of node whose subtrees are of the heights, which differ at most 2
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::rebalanceJoin(s32 node, s32 leftHeight, s32 rightHeight, s32& height)
+    {
+        s32 balance = leftHeight-rightHeight;
+        if(-1<=balance && balance<=1){
+            nodes_[node].balance_ = balance;
+            height = ((leftHeight<rightHeight)? rightHeight : leftHeight) + 1;
+            return node;
+        }
+        s32 newNode;
+        if(1<balance){
+            s32 left = nodes_[node].left_;
+            s32 a, b;
+            childHeights(left, leftHeight, a, b);
+            if(b<=a){
+                //LL
+                newNode = rotateRight(node);
+                s32 h = ((b<rightHeight)? rightHeight : b) + 1;
+                nodes_[node].balance_ = b-rightHeight;
+                nodes_[left].balance_ = a-h;
+                height = ((a<h)? h : a) + 1;
+            }else{
+                //LR
+                s32 middle = nodes_[left].right_;
+                s32 b0, b1;
+                childHeights(middle, b, b0, b1);
+                nodes_[node].left_ = rotateLeft(left);
+                newNode = rotateRight(node);
+                nodes_[left].balance_ = a-b0;
+                nodes_[node].balance_ = b1-rightHeight;
+                s32 h0 = ((a<b0)? b0 : a) + 1;
+                s32 h1 = ((b1<rightHeight)? rightHeight : b1) + 1;
+                nodes_[middle].balance_ = h0-h1;
+                height = ((h0<h1)? h1 : h0) + 1;
+            }
+        }else{
+            s32 right = nodes_[node].right_;
+            s32 a, b;
+            childHeights(right, rightHeight, b, a);
+            if(b<=a){
+                //RR
+                newNode = rotateLeft(node);
+                s32 h = ((b<leftHeight)? leftHeight : b) + 1;
+                nodes_[node].balance_ = leftHeight-b;
+                nodes_[right].balance_ = h-a;
+                height = ((a<h)? h : a) + 1;
+            }else{
+                //RL
+                s32 middle = nodes_[right].left_;
+                s32 b0, b1;
+                childHeights(middle, b, b0, b1);
+                nodes_[node].right_ = rotateRight(right);
+                newNode = rotateLeft(node);
+                nodes_[node].balance_ = leftHeight-b0;
+                nodes_[right].balance_ = b1-a;
+                s32 h0 = ((leftHeight<b0)? b0 : leftHeight) + 1;
+                s32 h1 = ((b1<a)? a : b1) + 1;
+                nodes_[middle].balance_ = h0-h1;
+                height = ((h0<h1)? h1 : h0) + 1;
             }
+        }
+        return newNode;
+    }
 
+    //---------------------------------------------------------------
+    /**
+    Split the subtree at node into the values less than the key and the greater ones,
+    returns the node equivalent to the key or -1
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::splitInternal(s32 node, s32 height, const value_type& key, s32& left, s32& leftHeight, s32& right, s32& rightHeight)
+    {
+        if(node<0){
+            left = right = -1;
+            leftHeight = rightHeight = 0;
+            return -1;
+        }
+        s32 subLeft = nodes_[node].left_;
+        s32 subRight = nodes_[node].right_;
+        s32 subLeftHeight, subRightHeight;
+        childHeights(node, height, subLeftHeight, subRightHeight);
+        s32 cmp = comparator_(nodes_[node].value_, key);
+        s32 middle = node;
+        if(cmp<0){
+            s32 l, lh;
+            middle = splitInternal(subRight, subRightHeight, key, l, lh, right, rightHeight);
+            left = joinInternal(subLeft, subLeftHeight, node, l, lh, leftHeight);
+        }else if(0<cmp){
+            s32 r, rh;
+            middle = splitInternal(subLeft, subLeftHeight, key, left, leftHeight, r, rh);
+            right = joinInternal(r, rh, node, subRight, subRightHeight, rightHeight);
         }else{
-            if(nodes_[right].left_<0){
-                nodes_[right].left_ = node.left_;
-                nodes_[right].balance_ = node.balance_;
+            left = subLeft;
+            leftHeight = subLeftHeight;
+            right = subRight;
+            rightHeight = subRightHeight;
+        }
+        if(0<=left){
+            nodes_[left].parent_ = -1;
+        }
+        if(0<=right){
+            nodes_[right].parent_ = -1;
+        }
+        return middle;
+    }
 
-                if(0 < numLevels) {
-                    nodes_[path[numLevels-1].node_].getSub(path[numLevels-1].which_) = right;
-                } else{
-                    root_ = right;
-                }
+    //---------------------------------------------------------------
+    /**
+    Unlink the least node of the subtree, returns the root of the rest
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::popMinInternal(s32 node, s32 height, s32& min, s32& resultHeight)
+    {
+        s32 leftHeight, rightHeight;
+        childHeights(node, height, leftHeight, rightHeight);
+        s32 left = nodes_[node].left_;
+        if(left<0){
+            min = node;
+            s32 right = nodes_[node].right_;
+            if(0<=right){
+                nodes_[right].parent_ = -1;
+            }
+            resultHeight = rightHeight;
+            return right;
+        }
+        s32 h;
+        left = popMinInternal(left, leftHeight, min, h);
+        nodes_[node].left_ = left;
+        if(0<=left){
+            nodes_[left].parent_ = node;
+        }
+        s32 result = rebalanceJoin(node, h, rightHeight, resultHeight);
+        nodes_[result].parent_ = -1;
+        return result;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Join the ordered subtrees without a middle node
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::join2Internal(s32 left, s32 leftHeight, s32 right, s32 rightHeight, s32& height)
+    {
+        if(left<0){
+            height = rightHeight;
+            return right;
+        }
+        if(right<0){
+            height = leftHeight;
+            return left;
+        }
+        s32 middle;
+        s32 h;
+        right = popMinInternal(right, rightHeight, middle, h);
+        return joinInternal(left, leftHeight, middle, right, h, height);
+    }
 
+    //---------------------------------------------------------------
+    /**
+    Move the nodes of the tree of less values into the other's pool, which this tree takes.
+    The nodes stay in place if the pool is shared, and the pool of this tree is kept if either pool is shared with another tree.
+    other becomes empty, root and otherRoot are the roots of the trees
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::mergePools(AVLTree& other, s32& root, s32& otherRoot)
+    {
+        resetPathCache();
+        other.resetPathCache();
+        s32 count = 0;
+        if(shares_pool(other)){
+            root = root_;
+            otherRoot = other.root_;
+        }else if(fewerNodes(other) && ownsPool() && other.ownsPool()){
+            swap(other);
+            otherRoot = root_;
+            root = transplant(other, other.root_, -1, count);
+        }else{
+            root = root_;
+            otherRoot = transplant(other, other.root_, -1, count);
+        }
+        clearOther(other);
+    }
 
-                TASSERT(numLevels<MaxLevels);
-                path[numLevels].node_ = right;
-                path[numLevels].which_ = AVLSub_Right;
-                ++numLevels;
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::initState(SetState& state)
+    {
+        state.matches_ = 0;
+        state.released_.head_ = state.released_.tail_ = -1;
+        state.otherReleased_.head_ = state.otherReleased_.tail_ = -1;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Destroy the value of node and chain it to released, without touching the free list
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::release(s32 node, Released& released)
+    {
+        nodes_[node].value_.~T();
+        nodes_[node].balance_ = released.head_;
+        nodes_[node].parent_ = -1;
+        nodes_[node].left_ = -1;
+        nodes_[node].right_ = -1;
+        if(released.tail_<0){
+            released.tail_ = node;
+        }
+        released.head_ = node;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::releaseInternal(s32 node, Released& released)
+    {
+        if(node<0){
+            return;
+        }
+        s32 left = nodes_[node].left_;
+        s32 right = nodes_[node].right_;
+        release(node, released);
+        releaseInternal(left, released);
+        releaseInternal(right, released);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::append(Released& to, const Released& from)
+    {
+        if(from.head_<0){
+            return;
+        }
+        if(to.head_<0){
+            to = from;
+            return;
+        }
+        nodes_[to.tail_].balance_ = from.head_;
+        to.tail_ = from.tail_;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Return the released nodes to the free list
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::reclaim(const Released& released)
+    {
+        if(released.head_<0){
+            return;
+        }
+        nodes_[released.tail_].balance_ = nodes_.pool_->empty_;
+        nodes_.pool_->empty_ = released.head_;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    s32 AVLTree<T, Allocator, Comparator>::unionTrees(AVLTree& other, const Fork& fork)
+    {
+        TASSERT(this != &other);
+        TASSERT(0 == handles_ && 0 == other.handles_);
+        s32 size = size_;
+        s32 otherSize = other.size_;
+        bool fewer = fewerNodes(other);
+        s32 root, otherRoot;
+        mergePools(other, root, otherRoot);
+        SetState state;
+        initState(state);
+        s32 h;
+        if(fewer){
+            root_ = unionInternal(otherRoot, height(otherRoot), root, height(root), false, fork, state, h);
+        }else{
+            root_ = unionInternal(root, height(root), otherRoot, height(otherRoot), true, fork, state, h);
+        }
+        if(0<=root_){
+            nodes_[root_].parent_ = -1;
+        }
+        reclaim(state.released_);
+        size_ = (0<=size && 0<=otherSize)? size + otherSize - state.matches_ : -1;
+        updateEnds();
+        return state.matches_;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    void AVLTree<T, Allocator, Comparator>::intersectTrees(AVLTree& other, const Fork& fork)
+    {
+        TASSERT(this != &other);
+        TASSERT(0 == handles_ && 0 == other.handles_);
+        resetPathCache();
+        other.resetPathCache();
+        SetState state;
+        initState(state);
+        s32 h;
+        root_ = intersectionInternal(root_, height(root_), other, other.root_, other.height(other.root_), fewerNodes(other), fork, state, h);
+        if(0<=root_){
+            nodes_[root_].parent_ = -1;
+        }
+        reclaim(state.released_);
+        other.reclaim(state.otherReleased_);
+        size_ = state.matches_;
+        updateEnds();
+        clearOther(other);
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    void AVLTree<T, Allocator, Comparator>::differenceTrees(AVLTree& other, const Fork& fork)
+    {
+        TASSERT(this != &other);
+        TASSERT(0 == handles_ && 0 == other.handles_);
+        resetPathCache();
+        other.resetPathCache();
+        SetState state;
+        initState(state);
+        s32 h;
+        root_ = differenceInternal(root_, height(root_), other, other.root_, other.height(other.root_), fewerNodes(other), fork, state, h);
+        if(0<=root_){
+            nodes_[root_].parent_ = -1;
+        }
+        reclaim(state.released_);
+        other.reclaim(state.otherReleased_);
+        addSize(-state.matches_);
+        updateEnds();
+        clearOther(other);
+    }
 
+    //---------------------------------------------------------------
+    /**
+    Union of the subtrees in the same pool, recursing over the structure of y.
+    The value of x is kept for equivalent values if keepX
+    */
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    s32 AVLTree<T, Allocator, Comparator>::unionInternal(s32 x, s32 xHeight, s32 y, s32 yHeight, bool keepX, const Fork& fork, SetState& state, s32& height)
+    {
+        if(y<0){
+            height = xHeight;
+            return x;
+        }
+        if(x<0){
+            height = yHeight;
+            return y;
+        }
+        s32 yLeft = nodes_[y].left_;
+        s32 yRight = nodes_[y].right_;
+        s32 yLeftHeight, yRightHeight;
+        childHeights(y, yHeight, yLeftHeight, yRightHeight);
+        s32 left, leftHeight, right, rightHeight;
+        s32 middle = splitInternal(x, xHeight, nodes_[y].value_, left, leftHeight, right, rightHeight);
+        if(0<=middle){
+            ++state.matches_;
+            if(keepX){
+                release(y, state.released_);
             }else{
-                s32 l = numLevels++;
-                for(;;){
-                    TASSERT(numLevels<MaxLevels);
-                    path[numLevels].which_ = AVLSub_Left;
-                    path[numLevels].node_ = right;
-                    ++numLevels;
-                    left = nodes_[right].left_;
-                    if(nodes_[left].left_<0){
-                        break;
-                    }
-                    right = left;
-                }
-                nodes_[left].left_ = node.left_;
-                nodes_[right].left_ = nodes_[left].right_;
+                release(middle, state.released_);
+                middle = y;
+            }
+        }else{
+            middle = y;
+        }
+        auto leftTask = [&](SetState& s){
+            left = unionInternal(left, leftHeight, yLeft, yLeftHeight, keepX, fork, s, leftHeight);
+        };
+        auto rightTask = [&](SetState& s){
+            right = unionInternal(right, rightHeight, yRight, yRightHeight, keepX, fork, s, rightHeight);
+        };
+        fork(ParallelMinHeight<=yHeight, state, leftTask, rightTask);
+        return joinInternal(left, leftHeight, middle, right, rightHeight, height);
+    }
 
-                nodes_[left].right_ = node.right_;
-                nodes_[left].balance_ = node.balance_;
+    //---------------------------------------------------------------
+    /**
+    Values of the subtree a of this tree which are in the subtree b of other.
+    Recurses over the structure of a if overA, otherwise of b, and splits the other subtree.
+    The nodes of b are only searched and destroyed, so they stay in the pool of other
+    */
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    s32 AVLTree<T, Allocator, Comparator>::intersectionInternal(s32 a, s32 aHeight, AVLTree& other, s32 b, s32 bHeight, bool overA, const Fork& fork, SetState& state, s32& height)
+    {
+        if(a<0 || b<0){
+            releaseInternal(a, state.released_);
+            other.releaseInternal(b, state.otherReleased_);
+            height = 0;
+            return -1;
+        }
+        s32 left, leftHeight, right, rightHeight;
+        if(overA){
+            s32 aLeft = nodes_[a].left_;
+            s32 aRight = nodes_[a].right_;
+            s32 aLeftHeight, aRightHeight;
+            childHeights(a, aHeight, aLeftHeight, aRightHeight);
+            s32 middle = other.splitInternal(b, bHeight, nodes_[a].value_, left, leftHeight, right, rightHeight);
+            auto leftTask = [&](SetState& s){
+                left = intersectionInternal(aLeft, aLeftHeight, other, left, leftHeight, overA, fork, s, leftHeight);
+            };
+            auto rightTask = [&](SetState& s){
+                right = intersectionInternal(aRight, aRightHeight, other, right, rightHeight, overA, fork, s, rightHeight);
+            };
+            fork(ParallelMinHeight<=aHeight, state, leftTask, rightTask);
+            if(middle<0){
+                release(a, state.released_);
+                return join2Internal(left, leftHeight, right, rightHeight, height);
+            }
+            ++state.matches_;
+            other.release(middle, state.otherReleased_);
+            return joinInternal(left, leftHeight, a, right, rightHeight, height);
+        }
 
-                if(0 < l) {
-                    nodes_[path[l - 1].node_].getSub(path[l - 1].which_) = left;
-                } else{
-                    root_ = left;
-                }
-                path[l].which_ = AVLSub_Right;
-                path[l].node_ = left;
+        s32 bLeft = other.nodes_[b].left_;
+        s32 bRight = other.nodes_[b].right_;
+        s32 bLeftHeight, bRightHeight;
+        other.childHeights(b, bHeight, bLeftHeight, bRightHeight);
+        s32 middle = splitInternal(a, aHeight, other.nodes_[b].value_, left, leftHeight, right, rightHeight);
+        other.release(b, state.otherReleased_);
+        auto leftTask = [&](SetState& s){
+            left = intersectionInternal(left, leftHeight, other, bLeft, bLeftHeight, overA, fork, s, leftHeight);
+        };
+        auto rightTask = [&](SetState& s){
+            right = intersectionInternal(right, rightHeight, other, bRight, bRightHeight, overA, fork, s, rightHeight);
+        };
+        fork(ParallelMinHeight<=bHeight, state, leftTask, rightTask);
+        if(middle<0){
+            return join2Internal(left, leftHeight, right, rightHeight, height);
+        }
+        ++state.matches_;
+        return joinInternal(left, leftHeight, middle, right, rightHeight, height);
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Values of the subtree a of this tree which are not in the subtree b of other.
+    Recurses over the structure of a if overA, otherwise of b, and splits the other subtree.
+    The nodes of b are only searched and destroyed, so they stay in the pool of other
+    */
+    template<class T, class Allocator, class Comparator>
+    template<class Fork>
+    s32 AVLTree<T, Allocator, Comparator>::differenceInternal(s32 a, s32 aHeight, AVLTree& other, s32 b, s32 bHeight, bool overA, const Fork& fork, SetState& state, s32& height)
+    {
+        if(a<0 || b<0){
+            other.releaseInternal(b, state.otherReleased_);
+            height = aHeight;
+            return a;
+        }
+        s32 left, leftHeight, right, rightHeight;
+        if(overA){
+            s32 aLeft = nodes_[a].left_;
+            s32 aRight = nodes_[a].right_;
+            s32 aLeftHeight, aRightHeight;
+            childHeights(a, aHeight, aLeftHeight, aRightHeight);
+            s32 middle = other.splitInternal(b, bHeight, nodes_[a].value_, left, leftHeight, right, rightHeight);
+            auto leftTask = [&](SetState& s){
+                left = differenceInternal(aLeft, aLeftHeight, other, left, leftHeight, overA, fork, s, leftHeight);
+            };
+            auto rightTask = [&](SetState& s){
+                right = differenceInternal(aRight, aRightHeight, other, right, rightHeight, overA, fork, s, rightHeight);
+            };
+            fork(ParallelMinHeight<=aHeight, state, leftTask, rightTask);
+            if(middle<0){
+                return joinInternal(left, leftHeight, a, right, rightHeight, height);
             }
+            ++state.matches_;
+            other.release(middle, state.otherReleased_);
+            release(a, state.released_);
+            return join2Internal(left, leftHeight, right, rightHeight, height);
         }
-        destroy(n);
-        balanceRemove(path, numLevels);
-        --size_;
+
+        s32 bLeft = other.nodes_[b].left_;
+        s32 bRight = other.nodes_[b].right_;
+        s32 bLeftHeight, bRightHeight;
+        other.childHeights(b, bHeight, bLeftHeight, bRightHeight);
+        s32 middle = splitInternal(a, aHeight, other.nodes_[b].value_, left, leftHeight, right, rightHeight);
+        other.release(b, state.otherReleased_);
+        if(0<=middle){
+            ++state.matches_;
+            release(middle, state.released_);
+        }
+        auto leftTask = [&](SetState& s){
+            left = differenceInternal(left, leftHeight, other, bLeft, bLeftHeight, overA, fork, s, leftHeight);
+        };
+        auto rightTask = [&](SetState& s){
+            right = differenceInternal(right, rightHeight, other, bRight, bRightHeight, overA, fork, s, rightHeight);
+        };
+        fork(ParallelMinHeight<=bHeight, state, leftTask, rightTask);
+        return join2Internal(left, leftHeight, right, rightHeight, height);
     }
 
+    //---------------------------------------------------------------
+    /**
+    Values of the subtree a which are not in the sorted values.
+    The middle value splits a, and the halves of the values are removed from the parts
+    */
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T,Allocator,Comparator>::clear()
+    template<class Fork>
+    s32 AVLTree<T, Allocator, Comparator>::differenceRange(s32 a, s32 aHeight, const value_type* values, s32 count, const Fork& fork, SetState& state, s32& height)
     {
-        clearInternal(root_);
-        root_ = -1;
-        size_ = 0;
+        if(a<0 || count<=0){
+            height = aHeight;
+            return a;
+        }
+        s32 half = count>>1;
+        s32 left, leftHeight, right, rightHeight;
+        s32 middle = splitInternal(a, aHeight, values[half], left, leftHeight, right, rightHeight);
+        if(0<=middle){
+            ++state.matches_;
+            release(middle, state.released_);
+        }
+        auto leftTask = [&](SetState& s){
+            left = differenceRange(left, leftHeight, values, half, fork, s, leftHeight);
+        };
+        auto rightTask = [&](SetState& s){
+            right = differenceRange(right, rightHeight, values+half+1, count-half-1, fork, s, rightHeight);
+        };
+        fork((1<<ParallelMinHeight)<=count, state, leftTask, rightTask);
+        return join2Internal(left, leftHeight, right, rightHeight, height);
     }
 
+    //---------------------------------------------------------------
+    /**
+    Reset other whose nodes are all destroyed
+    */
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T, Allocator, Comparator>::swap(AVLTree& rhs)
+    void AVLTree<T, Allocator, Comparator>::clearOther(AVLTree& other)
     {
-        tree::swap(size_, rhs.size_);
-        tree::swap(empty_, rhs.empty_);
-        tree::swap(nodes_.capacity_, rhs.nodes_.capacity_);
-        tree::swap(nodes_.items_, rhs.nodes_.items_);
-        tree::swap(root_, rhs.root_);
-        tree::swap(allocator_, rhs.allocator_);
-        tree::swap(comparator_, rhs.comparator_);
+        other.root_ = -1;
+        other.leftmost_ = -1;
+        other.rightmost_ = -1;
+        other.size_ = 0;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Move the subtree at node of source into this tree's nodes in the same shape
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::transplant(AVLTree& source, s32 node, s32 parent, s32& count)
+    {
+        if(node<0){
+            return -1;
+        }
+        s32 result = allocate();
+        node_type& n = source.nodes_[node];
+        TPLACEMENT_NEW(&nodes_[result].value_) value_type(tree::move(n.value_));
+        nodes_[result].balance_ = n.balance_;
+        nodes_[result].parent_ = parent;
+        s32 left = n.left_;
+        s32 right = n.right_;
+        source.destroy(node);
+        ++count;
+
+        s32 sub = transplant(source, left, result, count);
+        nodes_[result].left_ = sub;
+        sub = transplant(source, right, result, count);
+        nodes_[result].right_ = sub;
+        return result;
+    }
+
+    //---------------------------------------------------------------
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::updateEnds()
+    {
+        leftmost_ = root_;
+        rightmost_ = root_;
+        if(root_<0){
+            return;
+        }
+        while(0<=nodes_[leftmost_].left_){
+            leftmost_ = nodes_[leftmost_].left_;
+        }
+        while(0<=nodes_[rightmost_].right_){
+            rightmost_ = nodes_[rightmost_].right_;
+        }
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Number of levels to have at least count subtrees
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::parallelLevels(s32 count)
+    {
+        s32 levels = 0;
+        while(levels<MaxParallelLevels && (1<<levels)<count){
+            ++levels;
+        }
+        return levels;
+    }
+
+    //---------------------------------------------------------------
+    /**
+    Gather the subtrees at the level, and the nodes above them in order
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::gatherParallelItems(s32 node, s32 level, s32 levels, ParallelItem* items, s32 count) const
+    {
+        if(node<0){
+            return count;
+        }
+        if(levels<=level){
+            items[count].node_ = node;
+            items[count].subtree_ = 1;
+            return count+1;
+        }
+        count = gatherParallelItems(nodes_[node].left_, level+1, levels, items, count);
+        items[count].node_ = node;
+        items[count].subtree_ = 0;
+        ++count;
+        return gatherParallelItems(nodes_[node].right_, level+1, levels, items, count);
     }
 
     //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T,Allocator,Comparator>::clearInternal(s32 node)
+    s32 AVLTree<T,Allocator,Comparator>::clearInternal(s32 node)
     {
         if(node<0){
-            return;
+            return 0;
         }
         s32 left = nodes_[node].left_;
         s32 right = nodes_[node].right_;
 
         destroy(node);
 
-        clearInternal(left);
-        clearInternal(right);
+        return 1 + clearInternal(left) + clearInternal(right);
     }
 
     //---------------------------------------------------------------
     template<class T, class Allocator, class Comparator>
-    s32 AVLTree<T,Allocator,Comparator>::insertInternal(s32 node, value_type&& value)
+    s32 AVLTree<T,Allocator,Comparator>::countInternal(s32 node) const
     {
         if(node<0){
-            return create(tree::move(value));
+            return 0;
         }
-        Step path[MaxLevels];
+        return 1 + countInternal(nodes_[node].left_) + countInternal(nodes_[node].right_);
+    }
 
-        s32 level = 0;
-        s32 ni = node;
-        for(;;){
-            node_type& n = nodes_[ni];
-            s32 cmp = comparator_(n.value_, value);
+    //---------------------------------------------------------------
+    /**
+    Add to the size, which stays uncounted if negative
+    */
+    template<class T, class Allocator, class Comparator>
+    inline void AVLTree<T,Allocator,Comparator>::addSize(s32 count)
+    {
+        if(0<=size_){
+            size_ += count;
+        }
+    }
 
-            if(0 == cmp){
-                return node;
+    //---------------------------------------------------------------
+    /**
+    Whether this tree has less values than other, compared by the heights while either size is uncounted
+    */
+    template<class T, class Allocator, class Comparator>
+    bool AVLTree<T,Allocator,Comparator>::fewerNodes(const AVLTree& other) const
+    {
+        if(0<=size_ && 0<=other.size_){
+            return size_<other.size_;
+        }
+        return height(root_)<other.height(other.root_);
+    }
 
-            }else if(0<cmp){
-                TASSERT(level<MaxLevels);
-                path[level].node_ = ni;
-                path[level].which_ = AVLSub_Left;
-                ++level;
-                if(n.left_<0){
-                    nodes_[ni].left_ = create(tree::move(value));
-                    break;
-                }
-                ni = n.left_;
+    //---------------------------------------------------------------
+    /**
+    Insert the value into the subtree at node
+    path holds the ancestors of node, returns the position of the value
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T,Allocator,Comparator>::insertInternal(s32 node, Step* path, s32 level, value_type&& value)
+    {
+        s32 result = findInternal(node, path, level, value);
+        if(0<=result){
+            return result;
+        }
+        result = create(tree::move(value));
+        attach(result, path, level);
+        return result;
+    }
 
-            }else{
-                TASSERT(level<MaxLevels);
-                path[level].node_ = ni;
-                path[level].which_ = AVLSub_Right;
-                ++level;
-                if(n.right_<0){
-                    nodes_[ni].right_ = create(tree::move(value));
-                    break;
-                }
-                ni = n.right_;
+    //---------------------------------------------------------------
+    /**
+    Link the new node under the end of the path, and rebalance
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T,Allocator,Comparator>::attach(s32 node, Step* path, s32 level)
+    {
+        addSize(1);
+        if(level<=0){
+            TASSERT(root_<0);
+            root_ = node;
+            leftmost_ = node;
+            rightmost_ = node;
+            return;
+        }
+        s32 parent = path[level-1].node_;
+        s32 which = path[level-1].which_;
+        nodes_[parent].getSub(which) = node;
+        nodes_[node].parent_ = parent;
+        if(AVLSub_Left == which){
+            if(parent == leftmost_){
+                leftmost_ = node;
             }
+        }else if(parent == rightmost_){
+            rightmost_ = node;
         }
-        ++size_;
-        return balanceInsert(node, path, level);
+        root_ = balanceInsert(root_, path, level);
     }
 
     //---------------------------------------------------------------
@@ -514,7 +3444,8 @@ namespace tree
     }
 
     template<class T, class Allocator, class Comparator>
-    s32 AVLTree<T,Allocator,Comparator>::findInternal(s32 node, Step* path, s32& level, const value_type& value)
+    template<class Key>
+    s32 AVLTree<T,Allocator,Comparator>::findInternal(s32 node, Step* path, s32& level, const Key& value) const
     {
         while(0 <= node){
             s32 cmp = comparator_(nodes_[node].value_, value);
@@ -539,10 +3470,160 @@ namespace tree
         return node;
     }
 
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::iterator_type
+        AVLTree<T, Allocator, Comparator>::findCached(const value_type& value) const
+    {
+        PathCache& cache = *cache_;
+        //The subtree at path_[start] contains the value, if the value is between its nearest bounds
+        s32 start = cache.numLevels_-1;
+        for(;;){
+            while(0<cache.numUppers_ && start<=cache.uppers_[cache.numUppers_-1]){
+                --cache.numUppers_;
+            }
+            while(0<cache.numLowers_ && start<=cache.lowers_[cache.numLowers_-1]){
+                --cache.numLowers_;
+            }
+            if(0<cache.numUppers_ && comparator_(nodes_[cache.path_[cache.uppers_[cache.numUppers_-1]]].value_, value)<=0){
+                start = cache.uppers_[cache.numUppers_-1];
+                continue;
+            }
+            if(0<cache.numLowers_ && 0<=comparator_(nodes_[cache.path_[cache.lowers_[cache.numLowers_-1]]].value_, value)){
+                start = cache.lowers_[cache.numLowers_-1];
+                continue;
+            }
+            break;
+        }
+
+        s32 node;
+        if(0<start){
+            ++cache.hits_;
+            node = cache.path_[start];
+            cache.numLevels_ = start;
+        }else{
+            ++cache.misses_;
+            node = root_;
+            cache.numLevels_ = 0;
+        }
+
+        while(0<=node){
+            TASSERT(cache.numLevels_<MaxLevels);
+            cache.path_[cache.numLevels_++] = node;
+            s32 cmp = comparator_(nodes_[node].value_, value);
+            if(0 == cmp){
+                break;
+            }else if(cmp<0){
+                cache.lowers_[cache.numLowers_++] = cache.numLevels_-1;
+                node = nodes_[node].right_;
+            }else{
+                cache.uppers_[cache.numUppers_++] = cache.numLevels_-1;
+                node = nodes_[node].left_;
+            }
+        }
+        return node;
+    }
+
+    /**
+    Climb from node to the nearest subtree which contains the value
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::fingerStart(s32 node, const value_type& value) const
+    {
+        TASSERT(0<=node);
+        s32 cmp = comparator_(nodes_[node].value_, value);
+        if(0 == cmp){
+            return node;
+        }
+        //Go up while the parent is on the same side as node, or the parent does not bound the value
+        s32 which = (cmp<0)? AVLSub_Left : AVLSub_Right;
+        for(s32 parent = nodes_[node].parent_; 0<=parent; parent = nodes_[node].parent_){
+            if(nodes_[parent].getSub(which) == node){
+                s32 c = comparator_(nodes_[parent].value_, value);
+                if(0 == c){
+                    return parent;
+                }
+                if((AVLSub_Left == which)? (0<c) : (c<0)){
+                    break;
+                }
+            }
+            node = parent;
+        }
+        return node;
+    }
+
+    /**
+    Fill the path from the root to the parent of node, returns the number of levels
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::buildPath(s32 node, Step* path) const
+    {
+        s32 numLevels = 0;
+        for(s32 n = nodes_[node].parent_; 0<=n; n = nodes_[n].parent_){
+            ++numLevels;
+        }
+        TASSERT(numLevels<=MaxLevels);
+        for(s32 level = numLevels-1; 0<=level; --level){
+            s32 parent = nodes_[node].parent_;
+            path[level].node_ = parent;
+            path[level].which_ = (nodes_[parent].left_ == node)? AVLSub_Left : AVLSub_Right;
+            node = parent;
+        }
+        return numLevels;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    inline void AVLTree<T, Allocator, Comparator>::resetPathCache()
+    {
+        if(NULL != cache_){
+            cache_->numLevels_ = 0;
+            cache_->numUppers_ = 0;
+            cache_->numLowers_ = 0;
+        }
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::successor(s32 node) const
+    {
+        TASSERT(0<=node);
+        s32 right = nodes_[node].right_;
+        if(0<=right){
+            while(0<=nodes_[right].left_){
+                right = nodes_[right].left_;
+            }
+            return right;
+        }
+        s32 parent = nodes_[node].parent_;
+        while(0<=parent && nodes_[parent].right_ == node){
+            node = parent;
+            parent = nodes_[node].parent_;
+        }
+        return parent;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::predecessor(s32 node) const
+    {
+        TASSERT(0<=node);
+        s32 left = nodes_[node].left_;
+        if(0<=left){
+            while(0<=nodes_[left].right_){
+                left = nodes_[left].right_;
+            }
+            return left;
+        }
+        s32 parent = nodes_[node].parent_;
+        while(0<=parent && nodes_[parent].left_ == node){
+            node = parent;
+            parent = nodes_[node].parent_;
+        }
+        return parent;
+    }
+
     template<class T, class Allocator, class Comparator>
     void AVLTree<T,Allocator,Comparator>::balanceRemove(Step* path, s32 numLevels)
     {
-        while(0<--numLevels){
+        while(0<numLevels){
+            --numLevels;
             s32 newNode = -1;
             s32 ni = path[numLevels].node_;
             node_type& n = nodes_[ni];
@@ -559,11 +3640,11 @@ namespace tree
                     n.left_ = rotateLeft(n.left_);
                     newNode = rotateRight(ni);
                     updateBalance(newNode);
-                    nodes_[path[numLevels-1].node_].getSub( path[numLevels-1].which_ ) = newNode;
+                    replaceChild(path, numLevels, newNode);
                 }else{
                     //LL
                     newNode = rotateRight(ni);
-                    nodes_[path[numLevels-1].node_].getSub( path[numLevels-1].which_ ) = newNode;
+                    replaceChild(path, numLevels, newNode);
                     if(0==nodes_[newNode].balance_){
                         nodes_[newNode].balance_ = -1;
                         n.balance_ = 1;
@@ -580,11 +3661,11 @@ namespace tree
                     n.right_ = rotateRight(n.right_);
                     newNode = rotateLeft(ni);
                     updateBalance(newNode);
-                    nodes_[path[numLevels-1].node_].getSub( path[numLevels-1].which_ ) = newNode;
+                    replaceChild(path, numLevels, newNode);
                 }else{
                     //RR
                     newNode = rotateLeft(ni);
-                    nodes_[path[numLevels-1].node_].getSub( path[numLevels-1].which_ ) = newNode;
+                    replaceChild(path, numLevels, newNode);
                     if(0 == nodes_[newNode].balance_){
                         nodes_[newNode].balance_ = 1;
                         n.balance_ = -1;
@@ -601,6 +3682,16 @@ namespace tree
         }//while(0<numLevels)
     }
 
+    template<class T, class Allocator, class Comparator>
+    inline void AVLTree<T,Allocator,Comparator>::replaceChild(const Step* path, s32 level, s32 node)
+    {
+        if(0<level){
+            nodes_[path[level-1].node_].getSub(path[level-1].which_) = node;
+        }else{
+            root_ = node;
+        }
+    }
+
     //---------------------------------------------------------------
     // 右回転
     template<class T, class Allocator, class Comparator>
@@ -611,7 +3702,12 @@ namespace tree
         TASSERT(0<=left); //Left subree should exist
 
         nodes_[node].left_ = nodes_[left].right_;
+        if(0<=nodes_[left].right_){
+            nodes_[nodes_[left].right_].parent_ = node;
+        }
         nodes_[left].right_ = node;
+        nodes_[left].parent_ = nodes_[node].parent_;
+        nodes_[node].parent_ = left;
 
         return left;
     }
@@ -627,55 +3723,207 @@ namespace tree
         TASSERT(0<=right); //Right subree should exist
 
         nodes_[node].right_ = nodes_[right].left_;
+        if(0<=nodes_[right].left_){
+            nodes_[nodes_[right].left_].parent_ = node;
+        }
         nodes_[right].left_ = node;
+        nodes_[right].parent_ = nodes_[node].parent_;
+        nodes_[node].parent_ = right;
 
         return right;
     }
 
 
+    /**
+    Create the empty pool of this tree, if not yet
+    */
     template<class T, class Allocator, class Comparator>
-    s32 AVLTree<T, Allocator, Comparator>::create(value_type&& value)
+    void AVLTree<T, Allocator, Comparator>::acquirePool()
     {
-        if(empty_<0) {
-            s32 capacity = nodes_.capacity_ + 16;
-            node_type* nodes = allocator_.malloc<node_type>(sizeof(node_type)*capacity);
+        if(NULL != nodes_.pool_){
+            return;
+        }
+        NodePool* pool = allocator_.template malloc<NodePool>(sizeof(NodePool));
+        if(NULL == pool){
+            throw std::bad_alloc();
+        }
+        pool->references_ = 1;
+        pool->capacity_ = 0;
+        pool->empty_ = -1;
+        pool->items_ = NULL;
+        nodes_.pool_ = pool;
+    }
 
-            //Copy old nodes to new nodes
-            for(s32 i=0; i<nodes_.capacity_; ++i){
-                TPLACEMENT_NEW(&nodes[i].value_) value_type(tree::move(nodes_[i].value_));
-                nodes[i].balance_ = nodes_[i].balance_;
-                nodes[i].left_ = nodes_[i].left_;
-                nodes[i].right_ = nodes_[i].right_;
-            }
+    /**
+    Leave the pool, which is freed with the last tree. The nodes of this tree should be destroyed before
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::releasePool()
+    {
+        NodePool* pool = nodes_.pool_;
+        if(NULL == pool){
+            return;
+        }
+        nodes_.pool_ = NULL;
+        if(0 < --pool->references_){
+            return;
+        }
+        allocator_.free(pool->items_);
+        allocator_.free(pool);
+    }
 
-            //Initialize new nodes with default constructor
-            for(s32 i=nodes_.capacity_; i<capacity; ++i){
-                TPLACEMENT_NEW(&nodes[i].value_) value_type();
-                nodes[i].balance_ = i+1;
-            }
-            nodes[capacity-1].balance_ = empty_;
-            empty_ = nodes_.capacity_;
-            allocator_.free(nodes_.items_);
-            nodes_.capacity_ = capacity;
-            nodes_.items_ = nodes;
+    /**
+    Whether no other tree shares the pool
+    */
+    template<class T, class Allocator, class Comparator>
+    inline bool AVLTree<T, Allocator, Comparator>::ownsPool() const
+    {
+        return NULL == nodes_.pool_ || nodes_.pool_->references_ <= 1;
+    }
+
+    /**
+    Take an empty node, the value is not constructed
+    */
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::allocate()
+    {
+        if(nodes_.vacant()<0) {
+            acquirePool();
+            s32 capacity = grownCapacity();
+            relocate(allocateNodes(capacity), capacity);
         }
-        s32 result = empty_;
-        empty_ = nodes_[result].balance_;
+        NodePool* pool = nodes_.pool_;
+        s32 result = pool->empty_;
+        pool->empty_ = nodes_[result].balance_;
         nodes_[result].balance_ = 0;
+        nodes_[result].parent_ = -1;
         nodes_[result].left_ = -1;
         nodes_[result].right_ = -1;
-        nodes_[result].value_ = tree::move(value);
         return result;
     }
 
     template<class T, class Allocator, class Comparator>
-    void AVLTree<T, Allocator, Comparator>::destroy(s32 node)
+    s32 AVLTree<T, Allocator, Comparator>::grownCapacity() const
     {
-        nodes_[node].value_.~T();
-        nodes_[node].balance_ = empty_;
+        const s32 MaxCapacity = std::numeric_limits<s32>::max();
+        s32 capacity = nodes_.capacity();
+        if(MaxCapacity<=capacity){
+            throw std::length_error("AVLTree: too many nodes");
+        }
+        return (capacity<16)? 16
+            : (MaxCapacity/2<capacity)? MaxCapacity : capacity*2;
+    }
+
+    /**
+    Allocate an array of capacity nodes, the byte size is checked not to overflow
+    */
+    template<class T, class Allocator, class Comparator>
+    typename AVLTree<T, Allocator, Comparator>::node_type*
+        AVLTree<T, Allocator, Comparator>::allocateNodes(s32 capacity)
+    {
+        TASSERT(0<capacity);
+        if((std::numeric_limits<size_t>::max()/sizeof(node_type)) < static_cast<size_t>(capacity)){
+            throw std::length_error("AVLTree: too many nodes");
+        }
+        node_type* nodes = allocator_.template malloc<node_type>(sizeof(node_type)*static_cast<size_t>(capacity));
+        if(NULL == nodes){
+            throw std::bad_alloc();
+        }
+        return nodes;
+    }
+
+    /**
+    Move the nodes into the new array of capacity nodes, and chain the rest to the free list
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::relocate(node_type* nodes, s32 capacity)
+    {
+        NodePool* pool = nodes_.pool_;
+        TASSERT(pool->empty_<0);
+        TASSERT(pool->capacity_<capacity);
+
+        //Move old nodes to new nodes, all of them are in use by the trees of the pool when no empty node remains
+        for(s32 i=0; i<pool->capacity_; ++i){
+            TPLACEMENT_NEW(&nodes[i].value_) value_type(tree::move(nodes_[i].value_));
+            nodes_[i].value_.~T();
+            nodes[i].balance_ = nodes_[i].balance_;
+            nodes[i].parent_ = nodes_[i].parent_;
+            nodes[i].left_ = nodes_[i].left_;
+            nodes[i].right_ = nodes_[i].right_;
+        }
+
+        //Values of empty nodes are constructed when they are used
+        for(s32 i=pool->capacity_; i<capacity; ++i){
+            nodes[i].balance_ = i+1;
+        }
+        nodes[capacity-1].balance_ = -1;
+        pool->empty_ = pool->capacity_;
+        allocator_.free(pool->items_);
+        pool->capacity_ = capacity;
+        pool->items_ = nodes;
+    }
+
+    /**
+    Allocate a node and construct the value from args.
+    The args may refer to the values in the pool, so when the pool grows, the value is constructed
+    in the new array before the old nodes are moved and freed
+    */
+    template<class T, class Allocator, class Comparator>
+    template<class... Args>
+    s32 AVLTree<T, Allocator, Comparator>::construct(Args&&... args)
+    {
+        if(0<=nodes_.vacant()){
+            s32 result = allocate();
+            try{
+                TPLACEMENT_NEW(&nodes_[result].value_) value_type(tree::forward<Args>(args)...);
+            }catch(...){
+                deallocate(result);
+                throw;
+            }
+            return result;
+        }
+
+        acquirePool();
+        s32 capacity = grownCapacity();
+        node_type* nodes = allocateNodes(capacity);
+        s32 result = nodes_.capacity();
+        try{
+            TPLACEMENT_NEW(&nodes[result].value_) value_type(tree::forward<Args>(args)...);
+        }catch(...){
+            allocator_.free(nodes);
+            throw;
+        }
+        relocate(nodes, capacity);
+        //The first new node is the head of the free list
+        s32 node = allocate();
+        TASSERT(node == result);
+        return node;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    s32 AVLTree<T, Allocator, Comparator>::create(value_type&& value)
+    {
+        return construct(tree::move(value));
+    }
+
+    /**
+    Return the slot, whose value is not constructed, to the free list
+    */
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::deallocate(s32 node)
+    {
+        nodes_[node].balance_ = nodes_.pool_->empty_;
+        nodes_[node].parent_ = -1;
         nodes_[node].left_ = -1;
         nodes_[node].right_ = -1;
-        empty_ = node;
+        nodes_.pool_->empty_ = node;
+    }
+
+    template<class T, class Allocator, class Comparator>
+    void AVLTree<T, Allocator, Comparator>::destroy(s32 node)
+    {
+        nodes_[node].value_.~T();
+        deallocate(node);
     }
 
 #ifdef TREE_AVLTREE_ENABLE_DEBUGPRINT
@@ -701,5 +3949,198 @@ namespace tree
         printInternal(nodes_[node].right_, level+1);
     }
 #endif
+
+    //---------------------------------------------------------------
+    //---
+    //--- AVLMergeIterator
+    //---
+    //---------------------------------------------------------------
+    /**
+    @brief Iterate the union of several trees in order
+    Current positions of the trees are kept in a binary heap, and each tree is advanced only when its value is consumed.
+    The ends of the ranges are found once, so advancing compares only values of the heap.
+    Equivalent values are visited in the order of the trees.
+    */
+    template<class Tree>
+    class AVLMergeIterator
+    {
+    public:
+        typedef typename Tree::value_type value_type;
+        typedef typename Tree::iterator_type iterator_type;
+        typedef typename Tree::const_iterator const_iterator;
+        typedef typename Tree::allocator_type allocator_type;
+        typedef typename Tree::comparator_type comparator_type;
+
+        AVLMergeIterator(const Tree* const* trees, s32 numTrees);
+        /// Iterate values in [lower, upper)
+        AVLMergeIterator(const Tree* const* trees, s32 numTrees, const value_type& lower, const value_type& upper);
+        ~AVLMergeIterator();
+
+        inline bool valid() const;
+        inline const value_type& get() const;
+        /// Index of the tree which has the current value
+        inline s32 source() const;
+        /// Position of the current value in the source tree
+        inline iterator_type position() const;
+        void next();
+
+    private:
+        AVLMergeIterator(const AVLMergeIterator&) = delete;
+        AVLMergeIterator& operator=(const AVLMergeIterator&) = delete;
+
+        struct Cursor
+        {
+            const_iterator current_;
+            const_iterator end_;
+            s32 source_;
+        };
+
+        void initialize(const Tree* const* trees, const value_type* lower, const value_type* upper);
+        inline bool less(s32 c0, s32 c1) const;
+        void siftDown(s32 index);
+
+        s32 numCursors_;
+        Cursor* cursors_;
+        s32* heap_;
+        allocator_type allocator_;
+        comparator_type comparator_;
+    };
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    AVLMergeIterator<Tree>::AVLMergeIterator(const Tree* const* trees, s32 numTrees)
+        :numCursors_(numTrees)
+        ,cursors_(NULL)
+        ,heap_(NULL)
+    {
+        initialize(trees, NULL, NULL);
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    AVLMergeIterator<Tree>::AVLMergeIterator(const Tree* const* trees, s32 numTrees, const value_type& lower, const value_type& upper)
+        :numCursors_(numTrees)
+        ,cursors_(NULL)
+        ,heap_(NULL)
+    {
+        initialize(trees, &lower, &upper);
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    AVLMergeIterator<Tree>::~AVLMergeIterator()
+    {
+        for(s32 i=0; i<numCursors_; ++i){
+            cursors_[i].~Cursor();
+        }
+        allocator_.free(cursors_);
+        allocator_.free(heap_);
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    inline bool AVLMergeIterator<Tree>::valid() const
+    {
+        return 0<numCursors_ && cursors_[heap_[0]].current_ != cursors_[heap_[0]].end_;
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    inline const typename AVLMergeIterator<Tree>::value_type& AVLMergeIterator<Tree>::get() const
+    {
+        TASSERT(valid());
+        return *cursors_[heap_[0]].current_;
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    inline s32 AVLMergeIterator<Tree>::source() const
+    {
+        TASSERT(valid());
+        return cursors_[heap_[0]].source_;
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    inline typename AVLMergeIterator<Tree>::iterator_type AVLMergeIterator<Tree>::position() const
+    {
+        TASSERT(valid());
+        return cursors_[heap_[0]].current_;
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    void AVLMergeIterator<Tree>::next()
+    {
+        TASSERT(valid());
+        ++cursors_[heap_[0]].current_;
+        siftDown(0);
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    void AVLMergeIterator<Tree>::initialize(const Tree* const* trees, const value_type* lower, const value_type* upper)
+    {
+        TASSERT(0<=numCursors_);
+        if(numCursors_<=0){
+            numCursors_ = 0;
+            return;
+        }
+        cursors_ = allocator_.template malloc<Cursor>(sizeof(Cursor)*numCursors_);
+        heap_ = allocator_.template malloc<s32>(sizeof(s32)*numCursors_);
+        //An inverted range is empty, otherwise the cursors would start past their ends
+        bool empty = (NULL != lower && NULL != upper && 0<=comparator_(*lower, *upper));
+        for(s32 i=0; i<numCursors_; ++i){
+            TPLACEMENT_NEW(&cursors_[i]) Cursor();
+            const Tree& tree = *trees[i];
+            cursors_[i].end_ = (NULL == upper)? tree.end() : tree.to_iterator(tree.lower_bound(*upper));
+            cursors_[i].current_ = empty? cursors_[i].end_
+                : (NULL == lower)? tree.begin() : tree.to_iterator(tree.lower_bound(*lower));
+            cursors_[i].source_ = i;
+            heap_[i] = i;
+        }
+        for(s32 i=numCursors_/2-1; 0<=i; --i){
+            siftDown(i);
+        }
+    }
+
+    //---------------------------------------------------------------
+    // Exhausted cursors are greater than any other
+    template<class Tree>
+    inline bool AVLMergeIterator<Tree>::less(s32 c0, s32 c1) const
+    {
+        const Cursor& cursor0 = cursors_[c0];
+        const Cursor& cursor1 = cursors_[c1];
+        if(cursor1.current_ == cursor1.end_){
+            return cursor0.current_ != cursor0.end_;
+        }
+        if(cursor0.current_ == cursor0.end_){
+            return false;
+        }
+        s32 cmp = comparator_(*cursor0.current_, *cursor1.current_);
+        return (cmp<0) || (0 == cmp && c0<c1);
+    }
+
+    //---------------------------------------------------------------
+    template<class Tree>
+    void AVLMergeIterator<Tree>::siftDown(s32 index)
+    {
+        s32 cursor = heap_[index];
+        for(;;){
+            s32 child = index*2 + 1;
+            if(numCursors_<=child){
+                break;
+            }
+            if(child+1<numCursors_ && less(heap_[child+1], heap_[child])){
+                ++child;
+            }
+            if(!less(heap_[child], cursor)){
+                break;
+            }
+            heap_[index] = heap_[child];
+            index = child;
+        }
+        heap_[index] = cursor;
+    }
 }
 #endif //INC_TREE_AVLTREE_H_
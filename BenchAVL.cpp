@@ -0,0 +1,584 @@
+#include "catch_wrap.hpp"
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "AVLTree.h"
+#include "WorkStealingPool.h"
+
+//Benchmarks are hidden, run with the tag [benchmark]
+namespace
+{
+    const int BenchSamples = 1<<20;
+
+    struct Sum
+    {
+        Sum()
+            :sum_(0)
+        {}
+
+        void operator()(const int& value)
+        {
+            sum_ += value;
+        }
+
+        tree::s64 sum_;
+    };
+
+    void buildShuffled(tree::AVLTree<int>& avlTree, int samples)
+    {
+        std::vector<int> values(samples);
+        for(int i = 0; i < samples; ++i) {
+            values[i] = i;
+        }
+        std::mt19937 random(12345);
+        std::shuffle(values.begin(), values.end(), random);
+        for(int i = 0; i < samples; ++i) {
+            avlTree.insert(tree::move(values[i]));
+        }
+    }
+}
+
+TEST_CASE("BenchAVL_Append", "[.][benchmark]")
+{
+    BENCHMARK("insert monotonic")
+    {
+        tree::AVLTree<int> avlTree;
+        for(int i = 0; i < BenchSamples; ++i) {
+            int value = i;
+            avlTree.insert(tree::move(value));
+        }
+        EXPECT_EQ(BenchSamples, avlTree.size());
+    }
+
+    BENCHMARK("push_back monotonic")
+    {
+        tree::AVLTree<int> avlTree;
+        for(int i = 0; i < BenchSamples; ++i) {
+            int value = i;
+            avlTree.push_back(tree::move(value));
+        }
+        EXPECT_EQ(BenchSamples, avlTree.size());
+    }
+
+    std::vector<int> values(BenchSamples);
+    BENCHMARK("build_from_sorted")
+    {
+        for(int i = 0; i < BenchSamples; ++i) {
+            values[i] = i;
+        }
+        tree::AVLTree<int> avlTree;
+        avlTree.build_from_sorted(&values[0], BenchSamples);
+        EXPECT_EQ(BenchSamples, avlTree.size());
+    }
+}
+
+TEST_CASE("BenchAVL_Scan", "[.][benchmark]")
+{
+    tree::AVLTree<int> avlTree;
+    buildShuffled(avlTree, BenchSamples);
+    const int Queries = 1<<14;
+    const int ShortRange = 16;
+
+    BENCHMARK("short ranges with find")
+    {
+        Sum sum;
+        for(int i = 0; i < Queries; ++i) {
+            int lower = (i*7919)%(BenchSamples-ShortRange);
+            for(int j = lower; j < lower+ShortRange; ++j) {
+                tree::s32 pos = avlTree.find(j);
+                if(avlTree.end() != pos) {
+                    sum(avlTree.get(pos));
+                }
+            }
+        }
+        EXPECT_NE(0, sum.sum_);
+    }
+
+    BENCHMARK("short ranges with scan")
+    {
+        Sum sum;
+        for(int i = 0; i < Queries; ++i) {
+            int lower = (i*7919)%(BenchSamples-ShortRange);
+            avlTree.scan(lower, lower+ShortRange, sum);
+        }
+        EXPECT_NE(0, sum.sum_);
+    }
+
+    BENCHMARK("long range with iterator")
+    {
+        Sum sum;
+        for(tree::AVLTree<int>::const_iterator itr = avlTree.to_iterator(avlTree.lower_bound(BenchSamples/4)); itr != avlTree.end() && *itr < BenchSamples*3/4; ++itr) {
+            sum(*itr);
+        }
+        EXPECT_NE(0, sum.sum_);
+    }
+
+    BENCHMARK("long range with scan")
+    {
+        Sum sum;
+        avlTree.scan(BenchSamples/4, BenchSamples*3/4, sum);
+        EXPECT_NE(0, sum.sum_);
+    }
+}
+
+namespace
+{
+    struct Increment
+    {
+        void operator()(int& value)
+        {
+            //Keeps the order of the values
+            ++value;
+        }
+    };
+}
+
+TEST_CASE("BenchAVL_ParallelForEach", "[.][benchmark]")
+{
+    tree::AVLTree<int> avlTree;
+    buildShuffled(avlTree, BenchSamples*4);
+    tree::s32 hardware = static_cast<tree::s32>(std::thread::hardware_concurrency());
+    hardware = (hardware<1)? 1 : hardware;
+
+    BENCHMARK("traverse sum")
+    {
+        Sum sum;
+        avlTree.traverse<tree::TraversalOrder_InOrder>(sum);
+        EXPECT_NE(0, sum.sum_);
+    }
+
+    //Doubling threads, and all cores as the last point
+    for(tree::s32 threads = 1; threads <= hardware; threads = (threads < hardware && hardware < threads*2)? hardware : threads*2) {
+        tree::WorkStealingPool pool(threads);
+        std::vector<Sum> chunks(threads*4);
+        std::string name = std::string("threads ") + std::to_string(threads);
+
+        BENCHMARK(name + " ordered sum")
+        {
+            tree::s32 numChunks = avlTree.parallel_for_each_ordered(pool, Sum(), &chunks[0], static_cast<tree::s32>(chunks.size()));
+            tree::s64 sum = 0;
+            for(tree::s32 i = 0; i < numChunks; ++i) {
+                sum += chunks[i].sum_;
+            }
+            EXPECT_NE(0, sum);
+        }
+
+        BENCHMARK(name + " unordered increment")
+        {
+            Increment increment;
+            avlTree.parallel_for_each(pool, increment);
+        }
+    }
+}
+
+namespace
+{
+    struct KeepName
+    {
+        void operator()(std::string&) const
+        {
+        }
+    };
+
+    struct CopyName
+    {
+        std::string operator()(const std::string& key) const
+        {
+            return key;
+        }
+    };
+}
+
+TEST_CASE("BenchAVL_Upsert", "[.][benchmark]")
+{
+    //Long common prefixes make the comparisons dominate
+    const int Operations = BenchSamples/4;
+    std::vector<std::string> keys(Operations);
+    {
+        std::mt19937 random(12345);
+        for(int i = 0; i < Operations; ++i) {
+            keys[i] = "/usr/share/resource/" + std::to_string(random()%(Operations/2));
+        }
+    }
+
+    BENCHMARK("find then insert")
+    {
+        tree::AVLTree<std::string> avlTree;
+        for(int i = 0; i < Operations; ++i) {
+            tree::s32 pos = avlTree.find(keys[i]);
+            if(avlTree.end() != pos) {
+                KeepName()(avlTree.get(pos));
+            } else {
+                std::string name = keys[i];
+                avlTree.insert(tree::move(name));
+            }
+        }
+        EXPECT_LT(0, avlTree.size());
+    }
+
+    BENCHMARK("upsert")
+    {
+        tree::AVLTree<std::string> avlTree;
+        for(int i = 0; i < Operations; ++i) {
+            avlTree.upsert(keys[i], KeepName(), CopyName());
+        }
+        EXPECT_LT(0, avlTree.size());
+    }
+}
+
+namespace
+{
+    //Even values in [0, 2*samples)
+    void buildEven(tree::AVLTree<int>& avlTree, std::vector<int>& buffer, int samples)
+    {
+        buffer.resize(samples);
+        for(int i = 0; i < samples; ++i) {
+            buffer[i] = i*2;
+        }
+        avlTree.build_from_sorted(&buffer[0], samples);
+    }
+}
+
+TEST_CASE("BenchAVL_Batch", "[.][benchmark]")
+{
+    std::vector<int> buffer;
+
+    BENCHMARK("build only")
+    {
+        tree::AVLTree<int> avlTree;
+        buildEven(avlTree, buffer, BenchSamples);
+    }
+
+    for(int count = 1<<10; count <= BenchSamples; count <<= 3) {
+        std::vector<int> values(count);
+        std::mt19937 random(count);
+        std::string name = std::string("batch ") + std::to_string(count);
+
+        BENCHMARK(name + " insert")
+        {
+            tree::AVLTree<int> avlTree;
+            buildEven(avlTree, buffer, BenchSamples);
+            for(int i = 0; i < count; ++i) {
+                int value = static_cast<int>(random()%BenchSamples)*2 + 1;
+                avlTree.insert(tree::move(value));
+            }
+        }
+
+        BENCHMARK(name + " insert_batch")
+        {
+            tree::AVLTree<int> avlTree;
+            buildEven(avlTree, buffer, BenchSamples);
+            for(int i = 0; i < count; ++i) {
+                values[i] = static_cast<int>(random()%BenchSamples)*2 + 1;
+            }
+            avlTree.insert_batch(&values[0], count);
+        }
+
+        BENCHMARK(name + " remove")
+        {
+            tree::AVLTree<int> avlTree;
+            buildEven(avlTree, buffer, BenchSamples);
+            for(int i = 0; i < count; ++i) {
+                avlTree.remove(static_cast<int>(random()%BenchSamples)*2);
+            }
+        }
+
+        BENCHMARK(name + " remove_batch")
+        {
+            tree::AVLTree<int> avlTree;
+            buildEven(avlTree, buffer, BenchSamples);
+            for(int i = 0; i < count; ++i) {
+                values[i] = static_cast<int>(random()%BenchSamples)*2;
+            }
+            avlTree.remove_batch(&values[0], count);
+        }
+    }
+}
+
+TEST_CASE("BenchAVL_SetOperations", "[.][benchmark]")
+{
+    std::vector<int> buffer;
+    const int Delta = 1<<18;
+    std::vector<int> delta(Delta);
+    {
+        std::mt19937 random(12345);
+        for(int i = 0; i < Delta; ++i) {
+            delta[i] = static_cast<int>(random()%(BenchSamples*2));
+        }
+    }
+
+    BENCHMARK("build only")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+    }
+
+    BENCHMARK("union by insert")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+        tree::AVLTree<int> other;
+        for(int i = 0; i < Delta; ++i) {
+            int value = delta[i];
+            other.insert(tree::move(value));
+        }
+        for(tree::AVLTree<int>::const_iterator itr = other.begin(); itr != other.end(); ++itr) {
+            int value = *itr;
+            base.insert(tree::move(value));
+        }
+    }
+
+    BENCHMARK("set_union")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+        tree::AVLTree<int> other;
+        for(int i = 0; i < Delta; ++i) {
+            int value = delta[i];
+            other.insert(tree::move(value));
+        }
+        base.set_union(other);
+    }
+
+    BENCHMARK("difference by remove")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+        tree::AVLTree<int> other;
+        for(int i = 0; i < Delta; ++i) {
+            int value = delta[i];
+            other.insert(tree::move(value));
+        }
+        for(tree::AVLTree<int>::const_iterator itr = other.begin(); itr != other.end(); ++itr) {
+            base.remove(*itr);
+        }
+    }
+
+    BENCHMARK("set_difference")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+        tree::AVLTree<int> other;
+        for(int i = 0; i < Delta; ++i) {
+            int value = delta[i];
+            other.insert(tree::move(value));
+        }
+        base.set_difference(other);
+    }
+}
+
+TEST_CASE("BenchAVL_ParallelSetOperations", "[.][benchmark]")
+{
+    //Two trees of the same size, half of the values are shared
+    std::vector<int> buffer;
+    std::vector<int> odd(BenchSamples);
+    tree::s32 hardware = static_cast<tree::s32>(std::thread::hardware_concurrency());
+    hardware = (hardware<1)? 1 : hardware;
+
+    BENCHMARK("build only")
+    {
+        tree::AVLTree<int> base;
+        buildEven(base, buffer, BenchSamples);
+        tree::AVLTree<int> other;
+        buildEven(other, buffer, BenchSamples);
+    }
+
+    //Doubling threads, and all cores as the last point
+    for(tree::s32 threads = 1; threads <= hardware; threads = (threads < hardware && hardware < threads*2)? hardware : threads*2) {
+        tree::WorkStealingPool pool(threads);
+        std::string name = std::string("threads ") + std::to_string(threads);
+
+        BENCHMARK(name + " union")
+        {
+            tree::AVLTree<int> base;
+            buildEven(base, buffer, BenchSamples);
+            for(int i = 0; i < BenchSamples; ++i) {
+                buffer[i] = i + BenchSamples;
+            }
+            tree::AVLTree<int> other;
+            other.build_from_sorted(&buffer[0], BenchSamples);
+            base.parallel_set_union(pool, other);
+        }
+
+        BENCHMARK(name + " intersection")
+        {
+            tree::AVLTree<int> base;
+            buildEven(base, buffer, BenchSamples);
+            for(int i = 0; i < BenchSamples; ++i) {
+                buffer[i] = i + BenchSamples;
+            }
+            tree::AVLTree<int> other;
+            other.build_from_sorted(&buffer[0], BenchSamples);
+            base.parallel_set_intersection(pool, other);
+        }
+
+        BENCHMARK(name + " difference")
+        {
+            tree::AVLTree<int> base;
+            buildEven(base, buffer, BenchSamples);
+            for(int i = 0; i < BenchSamples; ++i) {
+                buffer[i] = i + BenchSamples;
+            }
+            tree::AVLTree<int> other;
+            other.build_from_sorted(&buffer[0], BenchSamples);
+            base.parallel_set_difference(pool, other);
+        }
+
+        BENCHMARK(name + " insert_batch")
+        {
+            tree::AVLTree<int> base;
+            buildEven(base, buffer, BenchSamples);
+            for(int i = 0; i < BenchSamples; ++i) {
+                odd[i] = i*2 + 1;
+            }
+            base.parallel_insert_batch(pool, &odd[0], BenchSamples);
+        }
+
+        BENCHMARK(name + " remove_batch")
+        {
+            tree::AVLTree<int> base;
+            buildEven(base, buffer, BenchSamples);
+            for(int i = 0; i < BenchSamples; ++i) {
+                odd[i] = i + BenchSamples;
+            }
+            base.parallel_remove_batch(pool, &odd[0], BenchSamples);
+        }
+    }
+}
+
+TEST_CASE("BenchAVL_EraseRange", "[.][benchmark]")
+{
+    //Expire the oldest quarter of the timestamps
+    std::vector<int> buffer;
+    const int Expired = BenchSamples/4;
+
+    BENCHMARK("build only")
+    {
+        tree::AVLTree<int> avlTree;
+        buildEven(avlTree, buffer, BenchSamples);
+    }
+
+    BENCHMARK("remove")
+    {
+        tree::AVLTree<int> avlTree;
+        buildEven(avlTree, buffer, BenchSamples);
+        for(int i = 0; i < Expired; ++i) {
+            avlTree.remove(i*2);
+        }
+    }
+
+    BENCHMARK("pop_min")
+    {
+        tree::AVLTree<int> avlTree;
+        buildEven(avlTree, buffer, BenchSamples);
+        for(int i = 0; i < Expired; ++i) {
+            avlTree.pop_min();
+        }
+    }
+
+    BENCHMARK("erase_range")
+    {
+        tree::AVLTree<int> avlTree;
+        buildEven(avlTree, buffer, BenchSamples);
+        avlTree.erase_range(0, Expired*2);
+    }
+}
+
+TEST_CASE("BenchAVL_FindBatch", "[.][benchmark]")
+{
+    //Eight times the usual samples, so the nodes spill well out of the last level cache
+    const int Samples = BenchSamples*8;
+    const int Queries = BenchSamples;
+    std::vector<int> buffer;
+    tree::AVLTree<int> avlTree;
+    buildEven(avlTree, buffer, Samples);
+
+    //Half of the queries hit, half miss between two keys
+    std::vector<int> values(Queries);
+    std::vector<tree::s32> results(Queries);
+    std::mt19937 random(12345);
+    for(int i = 0; i < Queries; ++i) {
+        values[i] = static_cast<int>(random()%(static_cast<tree::u32>(Samples)*2));
+    }
+
+    BENCHMARK("random find")
+    {
+        for(int i = 0; i < Queries; ++i) {
+            results[i] = avlTree.find(values[i]);
+        }
+    }
+
+    BENCHMARK("random find_batch")
+    {
+        avlTree.find_batch(&values[0], &results[0], Queries);
+    }
+}
+
+TEST_CASE("BenchAVL_FindSortedBatch", "[.][benchmark]")
+{
+    const int Samples = BenchSamples*8;
+    std::vector<int> buffer;
+    tree::AVLTree<int> avlTree;
+    buildEven(avlTree, buffer, Samples);
+
+    //Sorted queries, from sparse ones to one per key
+    for(int queries = 1<<10; queries <= Samples; queries <<= 3) {
+        std::vector<int> values(queries);
+        std::vector<tree::s32> results(queries);
+        std::mt19937 random(queries);
+        for(int i = 0; i < queries; ++i) {
+            values[i] = static_cast<int>(random()%(static_cast<tree::u32>(Samples)*2));
+        }
+        std::sort(values.begin(), values.end());
+        std::string name = std::string("sorted ") + std::to_string(queries);
+
+        BENCHMARK(name + " find")
+        {
+            for(int i = 0; i < queries; ++i) {
+                results[i] = avlTree.find(values[i]);
+            }
+        }
+
+        BENCHMARK(name + " find_batch")
+        {
+            avlTree.find_batch(&values[0], &results[0], queries);
+        }
+
+        BENCHMARK(name + " find_sorted_batch")
+        {
+            avlTree.find_sorted_batch(&values[0], &results[0], queries);
+        }
+    }
+}
+
+TEST_CASE("BenchAVL_SplitJoin", "[.][benchmark]")
+{
+    //Split at the median, the half of the values move between own pools, and stay in place in a shared pool
+    const int Rounds = 16;
+    std::vector<int> buffer;
+    tree::AVLTree<int> left;
+    tree::AVLTree<int> right;
+    buildEven(left, buffer, BenchSamples);
+
+    BENCHMARK("own pools split and join")
+    {
+        for(int i = 0; i < Rounds; ++i) {
+            left.split(BenchSamples, right);
+            left.join(right);
+        }
+    }
+
+    tree::AVLTree<int> sharedLeft;
+    tree::AVLTree<int> sharedRight;
+    sharedRight.share_pool(sharedLeft);
+    buildEven(sharedLeft, buffer, BenchSamples);
+
+    BENCHMARK("shared pool split and join")
+    {
+        for(int i = 0; i < Rounds; ++i) {
+            sharedLeft.split(BenchSamples, sharedRight);
+            sharedLeft.join(sharedRight);
+        }
+    }
+}
@@ -1,9 +1,18 @@
-#include "catch_wrap.hpp"
+﻿#include "catch_wrap.hpp"
 #include <iostream>
 #include <random>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <numeric>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <stdexcept>
 
 //#define TREE_AVLTREE_ENABLE_DEBUGPRINT
 #include "AVLTree.h"
+#include "WorkStealingPool.h"
 
 #ifdef TREE_AVLTREE_ENABLE_DEBUGPRINT
 #define DEBUGPRINT(tree)\
@@ -148,3 +157,1799 @@ TEST_CASE("TestAVL_Duplication")
         avlTree.clear();
     }
 }
+
+TEST_CASE("TestAVL_FindBatch")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    int samples[Samples];
+    int queries[Samples*2];
+    tree::s32 results[Samples*2];
+    tree::AVLTree<int> avlTree;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        samples[i] = i*2;
+    }
+    for(int i = 1; i < Samples; ++i) {
+        std::uniform_int_distribution<> dist(0, i - 1);
+        int j = dist(random);
+        int t = samples[i];
+        samples[i] = samples[j];
+        samples[j] = t;
+    }
+    avlTree.find_batch(samples, results, Samples);
+    for(int i = 0; i < Samples; ++i) {
+        EXPECT_EQ(avlTree.end(), results[i]);
+    }
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = samples[i];
+        avlTree.insert(tree::move(value));
+    }
+    //Even values exist, odd values don't
+    for(int i = 0; i < Samples*2; ++i) {
+        queries[i] = samples[i/2] + (i&1);
+    }
+    for(int count = 0; count <= Samples*2; count += 333) {
+        avlTree.find_batch(queries, results, count);
+        for(int i = 0; i < count; ++i) {
+            EXPECT_EQ(avlTree.find(queries[i]), results[i]);
+            if(0 == (queries[i]&1)) {
+                EXPECT_NE(avlTree.end(), results[i]);
+            } else {
+                EXPECT_EQ(avlTree.end(), results[i]);
+            }
+        }
+    }
+}
+
+TEST_CASE("TestAVL_FindSortedBatch")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    int queries[Samples*3];
+    tree::s32 results[Samples*3];
+    tree::AVLTree<int> avlTree;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        avlTree.insert(tree::move(value));
+    }
+    //Sorted queries with duplicates, includes absent values
+    for(int i = 0; i < Samples*3; ++i) {
+        queries[i] = static_cast<int>(random()%(Samples*4+2)) - 1;
+    }
+    std::sort(queries, queries+Samples*3);
+
+    for(int count = 0; count <= Samples*3; count += 500) {
+        avlTree.find_sorted_batch(queries, results, count);
+        for(int i = 0; i < count; ++i) {
+            EXPECT_EQ(avlTree.find(queries[i]), results[i]);
+        }
+    }
+    avlTree.clear();
+    avlTree.find_sorted_batch(queries, results, Samples);
+    for(int i = 0; i < Samples; ++i) {
+        EXPECT_EQ(avlTree.end(), results[i]);
+    }
+}
+
+TEST_CASE("TestAVL_Bounds")
+{
+    std::random_device device;
+    const int Samples = 512;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_EQ(avlTree.end(), avlTree.lower_bound(0));
+    EXPECT_EQ(avlTree.end(), avlTree.upper_bound(0));
+    EXPECT_EQ(avlTree.end(), avlTree.floor(0));
+    EXPECT_EQ(avlTree.end(), avlTree.ceiling(0));
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    for(int value = -1; value <= Samples*4; ++value) {
+        std::set<int>::iterator lower = set.lower_bound(value);
+        std::set<int>::iterator upper = set.upper_bound(value);
+        tree::s32 pos = avlTree.lower_bound(value);
+        if(lower == set.end()) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_EQ(*lower, avlTree.get(pos));
+        }
+        EXPECT_EQ(pos, avlTree.ceiling(value));
+
+        pos = avlTree.upper_bound(value);
+        if(upper == set.end()) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_EQ(*upper, avlTree.get(pos));
+        }
+
+        std::pair<tree::s32, tree::s32> range = avlTree.equal_range(value);
+        EXPECT_EQ(avlTree.lower_bound(value), range.first);
+        EXPECT_EQ(avlTree.upper_bound(value), range.second);
+
+        pos = avlTree.floor(value);
+        if(upper == set.begin()) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            --upper;
+            EXPECT_EQ(*upper, avlTree.get(pos));
+        }
+    }
+}
+
+namespace
+{
+    struct TimestampNotLess
+    {
+        explicit TimestampNotLess(int timestamp)
+            :timestamp_(timestamp)
+        {}
+
+        bool operator()(const std::pair<int, int>& value) const
+        {
+            return timestamp_ <= value.first;
+        }
+
+        int timestamp_;
+    };
+}
+
+TEST_CASE("TestAVL_Descend")
+{
+    std::random_device device;
+    const int Samples = 512;
+    typedef std::pair<int, int> Key;
+    tree::AVLTree<Key> avlTree;
+    std::set<Key> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_EQ(avlTree.end(), avlTree.descend(TimestampNotLess(0)));
+    for(int i = 0; i < Samples; ++i) {
+        Key value(static_cast<int>(random()%(Samples/4)), static_cast<int>(random()%Samples));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    //First (timestamp, id) whose timestamp is not less than t
+    for(int t = -1; t <= Samples/4; ++t) {
+        std::set<Key>::iterator itr = set.lower_bound(Key(t, -1));
+        tree::s32 pos = avlTree.descend(TimestampNotLess(t));
+        if(itr == set.end()) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_TRUE(*itr == avlTree.get(pos));
+        }
+    }
+}
+
+TEST_CASE("TestAVL_PathCache")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    tree::AVLTree<int> reference;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_FALSE(avlTree.is_path_cache_enabled());
+    avlTree.enable_path_cache(true);
+    EXPECT_TRUE(avlTree.is_path_cache_enabled());
+    EXPECT_EQ(avlTree.end(), avlTree.find(0));
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*2));
+        int copy = value;
+        avlTree.insert(tree::move(value));
+        reference.insert(tree::move(copy));
+    }
+
+    //Random walk over neighbouring keys, with occasional modifications
+    int key = Samples;
+    for(int i = 0; i < Samples*8; ++i) {
+        key += static_cast<int>(random()%7) - 3;
+        tree::s32 pos = avlTree.find(key);
+        tree::s32 expected = reference.find(key);
+        if(reference.end() == expected) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_NE(avlTree.end(), pos);
+            EXPECT_EQ(reference.get(expected), avlTree.get(pos));
+        }
+        if(0 == (i%61)) {
+            int value = key+1;
+            int copy = value;
+            avlTree.remove(value);
+            reference.remove(value);
+            if(0 == (i&1)) {
+                avlTree.insert(tree::move(value));
+                reference.insert(tree::move(copy));
+            }
+        }
+    }
+    EXPECT_LT(avlTree.path_cache_misses(), avlTree.path_cache_hits());
+    EXPECT_EQ(Samples*8+1, static_cast<int>(avlTree.path_cache_hits()+avlTree.path_cache_misses()));
+
+    avlTree.enable_path_cache(false);
+    EXPECT_EQ(0, avlTree.path_cache_hits());
+    EXPECT_EQ(reference.size(), avlTree.size());
+}
+
+TEST_CASE("TestAVL_Finger")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    //Near sequential keys, each inserted from the previous position
+    tree::s32 hint = avlTree.end();
+    int key = 0;
+    for(int i = 0; i < Samples; ++i) {
+        key += static_cast<int>(random()%5) - 1;
+        int value = key;
+        set.insert(value);
+        hint = avlTree.insert(hint, tree::move(value));
+        EXPECT_NE(avlTree.end(), hint);
+        EXPECT_EQ(key, avlTree.get(hint));
+    }
+    EXPECT_EQ(static_cast<tree::s32>(set.size()), avlTree.size());
+
+    tree::s32 from = avlTree.find(*set.begin());
+    for(int value = *set.begin() - 1; value <= key + 1; ++value) {
+        tree::s32 pos = avlTree.finger_find(from, value);
+        EXPECT_EQ(avlTree.find(value), pos);
+        if(set.end() == set.find(value)) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_EQ(value, avlTree.get(pos));
+            from = pos;
+        }
+    }
+    EXPECT_EQ(avlTree.find(key), avlTree.finger_find(avlTree.end(), key));
+}
+
+TEST_CASE("TestAVL_PushBack")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    //Mostly increasing keys, with some late and duplicated ones
+    int key = 0;
+    for(int i = 0; i < Samples; ++i) {
+        key += static_cast<int>(random()%8);
+        int value = (0 == (i%16))? key - static_cast<int>(random()%32) : key;
+        int expected = value;
+        set.insert(value);
+        tree::s32 pos = avlTree.push_back(tree::move(value));
+        EXPECT_NE(avlTree.end(), pos);
+        EXPECT_EQ(expected, avlTree.get(pos));
+        if(0 == (i%64)) {
+            avlTree.remove(key);
+            set.erase(key);
+        }
+    }
+    EXPECT_EQ(static_cast<tree::s32>(set.size()), avlTree.size());
+    for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+        EXPECT_NE(avlTree.end(), avlTree.find(*itr));
+    }
+    //The tree stays balanced, in-order values match
+    for(int value = *set.begin(); value < key; ++value) {
+        std::set<int>::iterator itr = set.upper_bound(value);
+        tree::s32 pos = avlTree.upper_bound(value);
+        if(set.end() == itr) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_EQ(*itr, avlTree.get(pos));
+        }
+    }
+}
+
+TEST_CASE("TestAVL_MinMax")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_EQ(avlTree.end(), avlTree.min());
+    EXPECT_EQ(avlTree.end(), avlTree.max());
+    avlTree.pop_min();
+    avlTree.pop_max();
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+        EXPECT_EQ(*set.begin(), avlTree.get(avlTree.min()));
+        EXPECT_EQ(*set.rbegin(), avlTree.get(avlTree.max()));
+    }
+    for(int i = 0; i < Samples/2; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.erase(value);
+        avlTree.remove(value);
+        EXPECT_EQ(*set.begin(), avlTree.get(avlTree.min()));
+        EXPECT_EQ(*set.rbegin(), avlTree.get(avlTree.max()));
+    }
+
+    //Drain from both ends
+    while(!set.empty()) {
+        EXPECT_EQ(*set.begin(), avlTree.get(avlTree.min()));
+        EXPECT_EQ(*set.rbegin(), avlTree.get(avlTree.max()));
+        if(set.size()&1) {
+            set.erase(set.begin());
+            avlTree.pop_min();
+        } else {
+            set.erase(--set.end());
+            avlTree.pop_max();
+        }
+        EXPECT_EQ(static_cast<tree::s32>(set.size()), avlTree.size());
+    }
+    EXPECT_EQ(avlTree.end(), avlTree.min());
+    EXPECT_EQ(avlTree.end(), avlTree.max());
+}
+
+TEST_CASE("TestAVL_Iterator")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    typedef tree::AVLTree<int> Tree;
+    Tree avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_TRUE(avlTree.begin() == avlTree.end());
+    EXPECT_TRUE(avlTree.rbegin() == avlTree.rend());
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    std::set<int>::iterator expected = set.begin();
+    for(int value : avlTree) {
+        EXPECT_EQ(*expected, value);
+        ++expected;
+    }
+    EXPECT_TRUE(set.end() == expected);
+
+    const Tree& constTree = avlTree;
+    EXPECT_EQ(static_cast<std::ptrdiff_t>(set.size()), std::distance(constTree.begin(), constTree.end()));
+    EXPECT_TRUE(std::equal(set.rbegin(), set.rend(), constTree.rbegin()));
+    EXPECT_EQ(std::accumulate(set.begin(), set.end(), 0), std::accumulate(avlTree.begin(), avlTree.end(), 0));
+
+    //Positions and iterators are interchangeable
+    for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+        Tree::iterator pos = avlTree.to_iterator(avlTree.find(*itr));
+        EXPECT_EQ(*itr, *pos);
+        std::set<int>::iterator next = itr;
+        ++next;
+        ++pos;
+        if(set.end() == next) {
+            EXPECT_EQ(avlTree.end(), pos);
+        } else {
+            EXPECT_EQ(*next, *pos);
+        }
+        --pos;
+        EXPECT_EQ(avlTree.find(*itr), pos);
+    }
+    Tree::iterator last = avlTree.end();
+    --last;
+    EXPECT_EQ(*set.rbegin(), *last);
+}
+
+namespace
+{
+    struct Collect : public tree::DefaultTraversal<int>
+    {
+        void operator()(int& value)
+        {
+            values_.push_back(value);
+        }
+
+        std::vector<int> values_;
+    };
+
+    struct CollectUntil
+    {
+        explicit CollectUntil(int count)
+            :count_(count)
+        {}
+
+        bool operator()(const int& value)
+        {
+            values_.push_back(value);
+            return static_cast<int>(values_.size()) < count_;
+        }
+
+        int count_;
+        std::vector<int> values_;
+    };
+}
+
+TEST_CASE("TestAVL_Traverse")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    {
+        Collect collect;
+        EXPECT_TRUE(avlTree.traverse<tree::TraversalOrder_InOrder>(collect));
+        EXPECT_TRUE(collect.values_.empty());
+    }
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    Collect inOrder;
+    Collect preOrder;
+    Collect postOrder;
+    EXPECT_TRUE(avlTree.traverse<tree::TraversalOrder_InOrder>(inOrder));
+    EXPECT_TRUE(avlTree.traverse<tree::TraversalOrder_PreOrder>(preOrder));
+    EXPECT_TRUE(avlTree.traverse<tree::TraversalOrder_PostOrder>(postOrder));
+    EXPECT_TRUE(std::equal(set.begin(), set.end(), inOrder.values_.begin()));
+    EXPECT_EQ(set.size(), inOrder.values_.size());
+    EXPECT_EQ(set.size(), preOrder.values_.size());
+    EXPECT_EQ(set.size(), postOrder.values_.size());
+
+    //Pre-order starts at the root, post-order ends at the root
+    EXPECT_EQ(preOrder.values_.front(), postOrder.values_.back());
+    //Check that the sequences are pre-order and post-order of a binary search tree
+    std::vector<int> stack;
+    int lower = -1;
+    for(size_t i = 0; i < preOrder.values_.size(); ++i) {
+        int value = preOrder.values_[i];
+        EXPECT_LT(lower, value);
+        while(!stack.empty() && stack.back() < value) {
+            lower = stack.back();
+            stack.pop_back();
+        }
+        stack.push_back(value);
+    }
+    stack.clear();
+    int upper = Samples*4;
+    for(size_t i = postOrder.values_.size(); 0 < i; --i) {
+        int value = postOrder.values_[i-1];
+        EXPECT_LT(value, upper);
+        while(!stack.empty() && value < stack.back()) {
+            upper = stack.back();
+            stack.pop_back();
+        }
+        stack.push_back(value);
+    }
+
+    const tree::AVLTree<int>& constTree = avlTree;
+    CollectUntil until(Samples/3);
+    EXPECT_FALSE(constTree.traverse<tree::TraversalOrder_InOrder>(until));
+    EXPECT_EQ(Samples/3, static_cast<int>(until.values_.size()));
+    EXPECT_TRUE(std::equal(until.values_.begin(), until.values_.end(), inOrder.values_.begin()));
+
+    tree::DefaultTraversal<int> defaultTraversal;
+    EXPECT_TRUE(avlTree.traverse<tree::TraversalOrder_PostOrder>(defaultTraversal));
+}
+
+TEST_CASE("TestAVL_Scan")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    {
+        Collect collect;
+        EXPECT_TRUE(avlTree.scan(0, Samples, collect));
+        EXPECT_TRUE(collect.values_.empty());
+    }
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    for(int i = 0; i < 256; ++i) {
+        int lower = static_cast<int>(random()%(Samples*4+2)) - 1;
+        int upper = lower + static_cast<int>(random()%(Samples/2));
+        Collect collect;
+        EXPECT_TRUE(avlTree.scan(lower, upper, collect));
+        std::set<int>::iterator begin = set.lower_bound(lower);
+        std::set<int>::iterator end = set.lower_bound(upper);
+        EXPECT_EQ(static_cast<size_t>(std::distance(begin, end)), collect.values_.size());
+        EXPECT_TRUE(std::equal(begin, end, collect.values_.begin()));
+    }
+
+    //Empty and inverted ranges
+    Collect collect;
+    EXPECT_TRUE(avlTree.scan(Samples, Samples, collect));
+    EXPECT_TRUE(avlTree.scan(Samples, 0, collect));
+    EXPECT_TRUE(collect.values_.empty());
+
+    const tree::AVLTree<int>& constTree = avlTree;
+    CollectUntil until(8);
+    EXPECT_FALSE(constTree.scan(0, Samples*4, until));
+    EXPECT_EQ(8, static_cast<int>(until.values_.size()));
+    EXPECT_TRUE(std::equal(until.values_.begin(), until.values_.end(), set.begin()));
+}
+
+namespace
+{
+    struct CollectString
+    {
+        void operator()(const std::string& value)
+        {
+            values_.push_back(value);
+        }
+
+        std::vector<std::string> values_;
+    };
+}
+
+TEST_CASE("TestAVL_PrefixScan")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    const char Alphabet[] = {'a', 'b', 'c', '\xFF'};
+    tree::AVLTree<std::string> avlTree;
+    std::set<std::string> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    for(int n = 0; n < 2; ++n) {
+        for(int i = 0; i < Samples; ++i) {
+            //Long enough strings to be allocated on the heap
+            std::string value(static_cast<size_t>(random()%6), 'a');
+            for(size_t j = 0; j < value.size(); ++j) {
+                value[j] = Alphabet[random()%4];
+            }
+            value += std::string(static_cast<size_t>(random()%32), 'z');
+            set.insert(value);
+            avlTree.insert(tree::move(value));
+        }
+        for(int i = 0; i < Samples/2; ++i) {
+            std::set<std::string>::iterator itr = set.begin();
+            std::advance(itr, random()%set.size());
+            avlTree.remove(*itr);
+            set.erase(itr);
+        }
+        EXPECT_EQ(static_cast<tree::s32>(set.size()), avlTree.size());
+
+        const char* prefixes[] = {"", "a", "ab", "c\xFF", "\xFF", "\xFF\xFF", "b\xFF\xFF", "abcabc"};
+        for(size_t i = 0; i < sizeof(prefixes)/sizeof(prefixes[0]); ++i) {
+            std::string prefix(prefixes[i]);
+            CollectString collect;
+            EXPECT_TRUE(avlTree.prefix_scan(prefix, collect));
+            std::vector<std::string> expected;
+            for(std::set<std::string>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+                if(0 == itr->compare(0, prefix.size(), prefix)) {
+                    expected.push_back(*itr);
+                }
+            }
+            EXPECT_TRUE(expected == collect.values_);
+        }
+        avlTree.clear();
+        set.clear();
+    }
+
+    std::string upper;
+    EXPECT_TRUE(tree::prefix_upper_bound(upper, std::string("ab")));
+    EXPECT_TRUE(std::string("ac") == upper);
+    EXPECT_TRUE(tree::prefix_upper_bound(upper, std::string("a\xFF")));
+    EXPECT_TRUE(std::string("b") == upper);
+    EXPECT_FALSE(tree::prefix_upper_bound(upper, std::string("\xFF\xFF")));
+}
+
+namespace
+{
+    struct AtomicSum
+    {
+        AtomicSum()
+            :count_(0)
+            ,sum_(0)
+        {}
+
+        void operator()(const int& value)
+        {
+            count_.fetch_add(1);
+            sum_.fetch_add(value);
+        }
+
+        std::atomic<int> count_;
+        std::atomic<tree::s64> sum_;
+    };
+}
+
+TEST_CASE("TestAVL_ParallelForEach")
+{
+    std::random_device device;
+    const int Samples = 4096;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    for(tree::s32 threads = 1; threads <= 4; ++threads) {
+        tree::WorkStealingPool pool(threads);
+        std::vector<Collect> chunks(threads*4);
+        {
+            AtomicSum sum;
+            avlTree.parallel_for_each(pool, sum);
+            EXPECT_EQ(0, sum.count_.load());
+            EXPECT_EQ(1, avlTree.parallel_for_each_ordered(pool, Collect(), &chunks[0], static_cast<tree::s32>(chunks.size())));
+            EXPECT_TRUE(chunks[0].values_.empty());
+        }
+
+        for(int i = 0; i < Samples; ++i) {
+            int value = static_cast<int>(random()%(Samples*4));
+            set.insert(value);
+            avlTree.insert(tree::move(value));
+        }
+        AtomicSum sum;
+        avlTree.parallel_for_each(pool, sum);
+        EXPECT_EQ(static_cast<int>(set.size()), sum.count_.load());
+        EXPECT_EQ(std::accumulate(set.begin(), set.end(), static_cast<tree::s64>(0)), sum.sum_.load());
+
+        for(tree::s32 maxChunks = 1; maxChunks <= static_cast<tree::s32>(chunks.size()); ++maxChunks) {
+            tree::s32 numChunks = avlTree.parallel_for_each_ordered(pool, Collect(), &chunks[0], maxChunks);
+            EXPECT_TRUE(0 < numChunks && numChunks <= maxChunks);
+            std::vector<int> values;
+            for(tree::s32 i = 0; i < numChunks; ++i) {
+                values.insert(values.end(), chunks[i].values_.begin(), chunks[i].values_.end());
+            }
+            EXPECT_EQ(set.size(), values.size());
+            EXPECT_TRUE(std::equal(set.begin(), set.end(), values.begin()));
+        }
+        avlTree.clear();
+        set.clear();
+    }
+}
+
+TEST_CASE("TestAVL_Partition")
+{
+    std::random_device device;
+    const int Samples = 16384;
+    const int MaxCount = 16;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+    tree::s32 bounds[MaxCount+1];
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    EXPECT_EQ(0, avlTree.partition(0, Samples, MaxCount, bounds));
+
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+    EXPECT_EQ(0, avlTree.partition(Samples, Samples, MaxCount, bounds));
+    EXPECT_EQ(0, avlTree.partition(Samples, 0, MaxCount, bounds));
+
+    for(int i = 0; i < 64; ++i) {
+        int lower = static_cast<int>(random()%(Samples*4));
+        int upper = lower + static_cast<int>(random()%(Samples*4));
+        tree::s32 count = 1 + static_cast<tree::s32>(random()%MaxCount);
+        tree::s32 n = avlTree.partition(lower, upper, count, bounds);
+        EXPECT_TRUE(n <= count);
+
+        //Sub-ranges are contiguous, and cover the range exactly
+        int total = static_cast<int>(std::distance(set.lower_bound(lower), set.lower_bound(upper)));
+        EXPECT_EQ(0 == total, 0 == n);
+        if(0 == n) {
+            continue;
+        }
+        EXPECT_EQ(avlTree.lower_bound(lower), bounds[0]);
+        EXPECT_EQ(avlTree.lower_bound(upper), bounds[n]);
+        int sum = 0;
+        int largest = 0;
+        for(tree::s32 j = 0; j < n; ++j) {
+            int size = 0;
+            for(tree::AVLTree<int>::const_iterator itr = avlTree.to_iterator(bounds[j]); itr != bounds[j+1]; ++itr) {
+                ++size;
+            }
+            EXPECT_LT(0, size);
+            sum += size;
+            largest = (largest < size)? size : largest;
+        }
+        EXPECT_EQ(total, sum);
+        //Wide ranges are split into all sub-ranges of similar sizes
+        if(count*64 <= total) {
+            EXPECT_EQ(count, n);
+            EXPECT_TRUE(largest <= total*2/count);
+        }
+    }
+}
+
+TEST_CASE("TestAVL_MergeIterator")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    const int NumTrees = 5;
+    typedef tree::AVLTree<int> Tree;
+    Tree trees[NumTrees];
+    const Tree* pointers[NumTrees];
+    std::multiset<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < NumTrees; ++i) {
+        pointers[i] = &trees[i];
+    }
+    {
+        tree::AVLMergeIterator<Tree> itr(pointers, NumTrees);
+        EXPECT_FALSE(itr.valid());
+    }
+
+    //The last tree stays empty
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*2));
+        Tree& avlTree = trees[random()%(NumTrees-1)];
+        if(avlTree.end() == avlTree.find(value)) {
+            set.insert(value);
+            avlTree.insert(tree::move(value));
+        }
+    }
+
+    std::vector<int> values;
+    int previousSource = -1;
+    for(tree::AVLMergeIterator<Tree> itr(pointers, NumTrees); itr.valid(); itr.next()) {
+        EXPECT_EQ(itr.get(), trees[itr.source()].get(itr.position()));
+        if(!values.empty() && values.back() == itr.get()) {
+            EXPECT_LT(previousSource, itr.source());
+        }
+        previousSource = itr.source();
+        values.push_back(itr.get());
+    }
+    EXPECT_EQ(set.size(), values.size());
+    EXPECT_TRUE(std::equal(set.begin(), set.end(), values.begin()));
+
+    for(int i = 0; i < 16; ++i) {
+        int lower = static_cast<int>(random()%(Samples*2));
+        int upper = lower + static_cast<int>(random()%Samples);
+        values.clear();
+        for(tree::AVLMergeIterator<Tree> itr(pointers, NumTrees, lower, upper); itr.valid(); itr.next()) {
+            values.push_back(itr.get());
+        }
+        std::multiset<int>::iterator begin = set.lower_bound(lower);
+        std::multiset<int>::iterator end = set.lower_bound(upper);
+        EXPECT_EQ(static_cast<size_t>(std::distance(begin, end)), values.size());
+        EXPECT_TRUE(std::equal(begin, end, values.begin()));
+    }
+
+    //Inverted and empty ranges
+    for(int i = 0; i < 16; ++i) {
+        int upper = static_cast<int>(random()%(Samples*2));
+        int lower = upper + static_cast<int>(random()%Samples);
+        tree::AVLMergeIterator<Tree> itr(pointers, NumTrees, lower, upper);
+        EXPECT_FALSE(itr.valid());
+    }
+}
+
+namespace
+{
+    struct Record
+    {
+        static int constructed_;
+
+        Record(int key, const std::string& name)
+            :key_(key)
+            ,name_(name)
+        {
+            ++constructed_;
+        }
+
+        Record(int key, const std::string& name, bool fail)
+            :key_(key)
+            ,name_(name)
+        {
+            if(fail) {
+                throw std::runtime_error("Record");
+            }
+            ++constructed_;
+        }
+
+        int key_;
+        std::string name_;
+    };
+    int Record::constructed_ = 0;
+
+    struct RecordComparator
+    {
+        tree::s32 operator()(const Record& v0, const Record& v1) const
+        {
+            return (v0.key_==v1.key_)? 0 : ((v0.key_<v1.key_)? -1 : 1);
+        }
+
+        tree::s32 operator()(const Record& v0, int key) const
+        {
+            return (v0.key_==key)? 0 : ((v0.key_<key)? -1 : 1);
+        }
+    };
+}
+
+TEST_CASE("TestAVL_Emplace")
+{
+    typedef tree::AVLTree<Record, tree::DefaultAVLAllocator, RecordComparator> Tree;
+    std::random_device device;
+    const int Samples = 1024;
+    Tree avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        int key = static_cast<int>(random()%Samples);
+        bool inserted = set.insert(key).second;
+        std::pair<Tree::iterator_type, bool> result = avlTree.emplace(key, "emplace");
+        EXPECT_EQ(inserted, result.second);
+        EXPECT_EQ(key, avlTree.get(result.first).key_);
+    }
+    EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+
+    for(int i = 0; i < Samples; ++i) {
+        int key = static_cast<int>(random()%(Samples*2));
+        bool inserted = set.insert(key).second;
+        int constructed = Record::constructed_;
+        std::pair<Tree::iterator_type, bool> result = avlTree.try_emplace(key, key, "try_emplace");
+        EXPECT_EQ(inserted, result.second);
+        EXPECT_EQ(constructed + (inserted? 1 : 0), Record::constructed_);
+        EXPECT_EQ(key, avlTree.get(result.first).key_);
+        if(inserted) {
+            EXPECT_EQ(std::string("try_emplace"), avlTree.get(result.first).name_);
+        }
+    }
+    EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+
+    std::vector<int> keys;
+    for(Tree::const_iterator itr = avlTree.begin(); itr != avlTree.end(); ++itr) {
+        keys.push_back(itr->key_);
+    }
+    EXPECT_EQ(set.size(), keys.size());
+    EXPECT_TRUE(std::equal(set.begin(), set.end(), keys.begin()));
+
+    //A throwing constructor returns the slot to the free list
+    {
+        Tree tree1;
+        tree1.emplace(0, "0");
+        Tree::iterator_type position = tree1.emplace(2, "2").first;
+        tree1.erase(position);
+        CHECK_THROWS_AS(tree1.emplace(1, "1", true), std::runtime_error);
+        CHECK_THROWS_AS(tree1.try_emplace(1, 1, "1", true), std::runtime_error);
+        EXPECT_EQ(1, tree1.size());
+        EXPECT_EQ(position, tree1.emplace(1, "1").first);
+    }
+
+    //The arguments refer to a value in the full pool, which is moved when the pool grows
+    {
+        tree::AVLTree<std::string> strings;
+        for(int i = 0; i < 16; ++i) {
+            std::string value = "/usr/share/resource/" + std::to_string(i);
+            strings.insert(tree::move(value));
+        }
+        std::string min = strings.get(strings.min());
+        std::pair<tree::AVLTree<std::string>::iterator_type, bool> result = strings.emplace(strings.get(strings.min()));
+        EXPECT_FALSE(result.second);
+        EXPECT_EQ(16, strings.size());
+        EXPECT_EQ(min, strings.get(result.first));
+
+        Tree tree1;
+        for(int i = 0; i < 16; ++i) {
+            tree1.emplace(i, "/usr/share/resource/" + std::to_string(i));
+        }
+        std::string name = tree1.get(tree1.min()).name_;
+        std::pair<Tree::iterator_type, bool> inserted = tree1.try_emplace(16, 16, tree1.get(tree1.min()).name_);
+        EXPECT_TRUE(inserted.second);
+        EXPECT_EQ(17, tree1.size());
+        EXPECT_EQ(name, tree1.get(inserted.first).name_);
+    }
+}
+
+namespace
+{
+    struct AppendName
+    {
+        void operator()(Record& record) const
+        {
+            record.name_ += "u";
+        }
+    };
+
+    struct CreateRecord
+    {
+        Record operator()(int key) const
+        {
+            return Record(key, "c");
+        }
+    };
+
+    struct FailRecord
+    {
+        Record operator()(int key) const
+        {
+            return Record(key, "f", true);
+        }
+    };
+
+    /// Key of a path under a directory, which can be a value in the tree
+    struct ChildKey
+    {
+        ChildKey(const std::string& directory, const char* name)
+            :directory_(directory)
+            ,name_(name)
+        {}
+
+        std::string path() const
+        {
+            return directory_ + name_;
+        }
+
+        const std::string& directory_;
+        const char* name_;
+    };
+
+    struct PathComparator
+    {
+        tree::s32 operator()(const std::string& v0, const std::string& v1) const
+        {
+            return v0.compare(v1);
+        }
+
+        tree::s32 operator()(const std::string& v0, const ChildKey& key) const
+        {
+            return v0.compare(key.path());
+        }
+    };
+
+    struct KeepPath
+    {
+        void operator()(std::string&) const
+        {
+        }
+    };
+
+    struct CreatePath
+    {
+        std::string operator()(const ChildKey& key) const
+        {
+            return key.path();
+        }
+    };
+}
+
+TEST_CASE("TestAVL_Upsert")
+{
+    typedef tree::AVLTree<Record, tree::DefaultAVLAllocator, RecordComparator> Tree;
+    std::random_device device;
+    const int Samples = 1024;
+    Tree avlTree;
+    std::map<int, std::string> map;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        int key = static_cast<int>(random()%(Samples/2));
+        if(random()&1) {
+            std::string name = std::to_string(i);
+            bool inserted = (map.end() == map.find(key));
+            map[key] = name;
+            std::pair<Tree::iterator_type, bool> result = avlTree.insert_or_assign(Record(key, name));
+            EXPECT_EQ(inserted, result.second);
+            EXPECT_EQ(name, avlTree.get(result.first).name_);
+        } else {
+            std::map<int, std::string>::iterator itr = map.find(key);
+            bool inserted = (map.end() == itr);
+            if(inserted) {
+                map[key] = "c";
+            } else {
+                itr->second += "u";
+            }
+            std::pair<Tree::iterator_type, bool> result = avlTree.upsert(key, AppendName(), CreateRecord());
+            EXPECT_EQ(inserted, result.second);
+            EXPECT_EQ(map[key], avlTree.get(result.first).name_);
+        }
+    }
+    EXPECT_EQ(map.size(), static_cast<size_t>(avlTree.size()));
+
+    std::map<int, std::string>::const_iterator expected = map.begin();
+    for(Tree::const_iterator itr = avlTree.begin(); itr != avlTree.end(); ++itr, ++expected) {
+        EXPECT_EQ(expected->first, itr->key_);
+        EXPECT_EQ(expected->second, itr->name_);
+    }
+
+    //A throwing creator returns the slot to the free list
+    {
+        Tree tree1;
+        tree1.upsert(0, AppendName(), CreateRecord());
+        Tree::iterator_type position = tree1.upsert(2, AppendName(), CreateRecord()).first;
+        tree1.erase(position);
+        CHECK_THROWS_AS(tree1.upsert(1, AppendName(), FailRecord()), std::runtime_error);
+        EXPECT_EQ(1, tree1.size());
+        EXPECT_EQ(position, tree1.upsert(1, AppendName(), CreateRecord()).first);
+    }
+
+    //The key refers to a value in the full pool, which is moved when the pool grows
+    {
+        typedef tree::AVLTree<std::string, tree::DefaultAVLAllocator, PathComparator> PathTree;
+        PathTree paths;
+        for(int i = 0; i < 16; ++i) {
+            std::string path = "/usr/share/resource/" + std::to_string(i);
+            paths.insert(tree::move(path));
+        }
+        std::string expected = paths.get(paths.min()) + "/child";
+        std::pair<PathTree::iterator_type, bool> result = paths.upsert(ChildKey(paths.get(paths.min()), "/child"), KeepPath(), CreatePath());
+        EXPECT_TRUE(result.second);
+        EXPECT_EQ(17, paths.size());
+        EXPECT_EQ(expected, paths.get(result.first));
+    }
+}
+
+TEST_CASE("TestAVL_Erase")
+{
+    std::random_device device;
+    const int Samples = 1024;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        int value = static_cast<int>(random()%(Samples*4));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    //Erase the multiples of 3 while iterating
+    for(tree::s32 pos = avlTree.min(); avlTree.end() != pos;) {
+        int value = avlTree.get(pos);
+        if(0 == value%3) {
+            set.erase(value);
+            pos = avlTree.erase(pos);
+            EXPECT_EQ(avlTree.end(), avlTree.find(value));
+            if(avlTree.end() != pos) {
+                EXPECT_LT(value, avlTree.get(pos));
+                EXPECT_EQ(*set.upper_bound(value), avlTree.get(pos));
+            }
+        } else {
+            pos = avlTree.upper_bound(value);
+        }
+    }
+    EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+
+    //Find then erase at random
+    while(!set.empty()) {
+        std::set<int>::iterator itr = set.begin();
+        std::advance(itr, random()%set.size());
+        tree::s32 pos = avlTree.find(*itr);
+        EXPECT_NE(avlTree.end(), pos);
+        set.erase(itr);
+        avlTree.erase(pos);
+        EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+        if(!set.empty()) {
+            EXPECT_EQ(*set.begin(), avlTree.get(avlTree.min()));
+            EXPECT_EQ(*set.rbegin(), avlTree.get(avlTree.max()));
+        }
+    }
+    EXPECT_EQ(avlTree.end(), avlTree.min());
+}
+
+TEST_CASE("TestAVL_Extract")
+{
+    std::random_device device;
+    const int Samples = 512;
+    tree::AVLTree<std::string> avlTree;
+    std::set<std::string> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    for(int i = 0; i < Samples; ++i) {
+        std::string value = "value" + std::to_string(random()%(Samples*2));
+        set.insert(value);
+        avlTree.insert(tree::move(value));
+    }
+
+    while(!set.empty()) {
+        std::set<std::string>::iterator itr = set.begin();
+        std::advance(itr, random()%set.size());
+        tree::s32 pos = avlTree.find(*itr);
+        EXPECT_NE(avlTree.end(), pos);
+        std::string value = avlTree.extract(pos);
+        EXPECT_EQ(*itr, value);
+        set.erase(itr);
+        EXPECT_EQ(avlTree.end(), avlTree.find(value));
+        EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+    }
+}
+
+namespace
+{
+    struct Counted
+    {
+        static int moves_;
+        static int alive_;
+
+        explicit Counted(int key)
+            :key_(key)
+        {
+            ++alive_;
+        }
+
+        Counted(Counted&& rhs)
+            :key_(rhs.key_)
+        {
+            ++moves_;
+            ++alive_;
+        }
+
+        ~Counted()
+        {
+            --alive_;
+        }
+
+        Counted& operator=(Counted&& rhs)
+        {
+            key_ = rhs.key_;
+            ++moves_;
+            return *this;
+        }
+
+        bool operator==(const Counted& rhs) const
+        {
+            return key_ == rhs.key_;
+        }
+
+        bool operator<(const Counted& rhs) const
+        {
+            return key_ < rhs.key_;
+        }
+
+        int key_;
+    };
+    int Counted::moves_ = 0;
+    int Counted::alive_ = 0;
+}
+
+TEST_CASE("TestAVL_NodeHandle")
+{
+    typedef tree::AVLTree<Counted> Tree;
+    std::random_device device;
+    const int Samples = 512;
+    std::set<int> set0;
+    std::set<int> set1;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+    {
+        Tree tree0;
+        Tree tree1;
+        for(int i = 0; i < Samples; ++i) {
+            int key = static_cast<int>(random()%(Samples*2));
+            if(set0.insert(key).second) {
+                tree0.emplace(key);
+            }
+        }
+
+        //Reserve the nodes of the other tree, relocating them moves the values
+        for(int i = 1; i <= Samples; ++i) {
+            tree1.emplace(-i);
+        }
+        while(0 < tree1.size()) {
+            tree1.erase(tree1.min());
+        }
+
+        //Move the odd keys to the other tree
+        int moved = 0;
+        int moves = Counted::moves_;
+        for(tree::s32 pos = tree0.min(); tree0.end() != pos;) {
+            int key = tree0.get(pos).key_;
+            tree::s32 next = tree0.upper_bound(Counted(key));
+            if(key & 1) {
+                Tree::node_handle handle = tree0.extract_node(pos);
+                EXPECT_TRUE(static_cast<bool>(handle));
+                EXPECT_EQ(key, handle.value().key_);
+                std::pair<tree::s32, bool> result = tree1.insert(tree::move(handle));
+                EXPECT_TRUE(result.second);
+                EXPECT_TRUE(handle.empty());
+                EXPECT_EQ(key, tree1.get(result.first).key_);
+                set0.erase(key);
+                set1.insert(key);
+                ++moved;
+            }
+            pos = next;
+        }
+        EXPECT_EQ(moved, Counted::moves_ - moves);
+        EXPECT_EQ(set0.size(), static_cast<size_t>(tree0.size()));
+        EXPECT_EQ(set1.size(), static_cast<size_t>(tree1.size()));
+
+        //Reinsert into the same tree without moving
+        moves = Counted::moves_;
+        for(int i = 0; i < Samples/4 && !set1.empty(); ++i) {
+            std::set<int>::iterator itr = set1.begin();
+            std::advance(itr, random()%set1.size());
+            tree::s32 pos = tree1.find(Counted(*itr));
+            Tree::node_handle handle = tree1.extract_node(pos);
+            EXPECT_EQ(set1.size()-1, static_cast<size_t>(tree1.size()));
+            EXPECT_EQ(tree1.end(), tree1.find(Counted(*itr)));
+            std::pair<tree::s32, bool> result = tree1.insert(tree::move(handle));
+            EXPECT_TRUE(result.second);
+            EXPECT_EQ(pos, result.first);
+        }
+        EXPECT_EQ(moves, Counted::moves_);
+
+        //The handle keeps the value when an equivalent value exists
+        if(!set1.empty()) {
+            int key = *set1.begin();
+            tree0.emplace(key);
+            Tree::node_handle handle = tree0.extract_node(tree0.find(Counted(key)));
+            std::pair<tree::s32, bool> result = tree1.insert(tree::move(handle));
+            EXPECT_FALSE(result.second);
+            EXPECT_FALSE(handle.empty());
+            EXPECT_EQ(key, tree1.get(result.first).key_);
+        }
+
+        std::vector<int> keys;
+        for(Tree::const_iterator itr = tree1.begin(); itr != tree1.end(); ++itr) {
+            keys.push_back(itr->key_);
+        }
+        EXPECT_EQ(set1.size(), keys.size());
+        EXPECT_TRUE(std::equal(set1.begin(), set1.end(), keys.begin()));
+        EXPECT_EQ(static_cast<int>(set0.size()+set1.size()), Counted::alive_);
+    }
+    EXPECT_EQ(0, Counted::alive_);
+}
+
+TEST_CASE("TestAVL_BuildFromSorted")
+{
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    tree::AVLTree<int> avlTree;
+    for(int count = 0; count < 300; count += 1 + static_cast<int>(random()%7)) {
+        std::vector<int> values(count);
+        for(int i = 0; i < count; ++i) {
+            values[i] = i*2;
+        }
+        avlTree.build_from_sorted(count? &values[0] : NULL, count);
+        EXPECT_EQ(count, avlTree.size());
+
+        std::vector<int> result;
+        for(tree::AVLTree<int>::const_iterator itr = avlTree.begin(); itr != avlTree.end(); ++itr) {
+            result.push_back(*itr);
+        }
+        EXPECT_EQ(values, result);
+        for(int i = 0; i < count; ++i) {
+            EXPECT_EQ(i*2, avlTree.get(avlTree.find(i*2)));
+            EXPECT_EQ(avlTree.end(), avlTree.find(i*2+1));
+        }
+        if(0 < count) {
+            EXPECT_EQ(0, avlTree.get(avlTree.min()));
+            EXPECT_EQ((count-1)*2, avlTree.get(avlTree.max()));
+        }
+
+        //The balance factors are kept through the following updates
+        std::set<int> set(values.begin(), values.end());
+        for(int i = 0; i < count; ++i) {
+            int value = static_cast<int>(random()%(count*2+2));
+            if(random()&1) {
+                set.insert(value);
+                avlTree.insert(tree::move(value));
+            } else {
+                set.erase(value);
+                avlTree.remove(value);
+            }
+        }
+        result.clear();
+        for(tree::AVLTree<int>::const_iterator itr = avlTree.begin(); itr != avlTree.end(); ++itr) {
+            result.push_back(*itr);
+        }
+        EXPECT_EQ(set.size(), result.size());
+        EXPECT_TRUE(std::equal(set.begin(), set.end(), result.begin()));
+    }
+}
+
+TEST_CASE("TestAVL_Batch")
+{
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+    const int Samples = 4096;
+    for(int n = 0; n < 64; ++n) {
+        //Both of the merged and the per-value paths are taken
+        int count = static_cast<int>(random()%((n&1)? Samples : 64));
+        std::vector<int> values(count);
+        for(int i = 0; i < count; ++i) {
+            values[i] = static_cast<int>(random()%Samples);
+        }
+        int expected = 0;
+        if(random()%3) {
+            for(int i = 0; i < count; ++i) {
+                expected += set.insert(values[i]).second? 1 : 0;
+            }
+            EXPECT_EQ(expected, avlTree.insert_batch(count? &values[0] : NULL, count));
+        } else {
+            for(int i = 0; i < count; ++i) {
+                expected += static_cast<int>(set.erase(values[i]));
+            }
+            EXPECT_EQ(expected, avlTree.remove_batch(count? &values[0] : NULL, count));
+        }
+        EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+
+        std::vector<int> result;
+        for(tree::AVLTree<int>::const_iterator itr = avlTree.begin(); itr != avlTree.end(); ++itr) {
+            result.push_back(*itr);
+        }
+        EXPECT_EQ(set.size(), result.size());
+        EXPECT_TRUE(std::equal(set.begin(), set.end(), result.begin()));
+    }
+}
+
+TEST_CASE("TestAVL_SplitJoin")
+{
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    for(int n = 0; n < 64; ++n) {
+        tree::AVLTree<int> left;
+        tree::AVLTree<int> right;
+        std::set<int> set;
+        int count = static_cast<int>(random()%2048);
+        for(int i = 0; i < count; ++i) {
+            int value = static_cast<int>(random()%4096);
+            set.insert(value);
+            left.insert(tree::move(value));
+        }
+
+        int key = static_cast<int>(random()%4098) - 1;
+        left.split(key, right);
+        std::set<int>::iterator bound = set.lower_bound(key);
+        EXPECT_EQ(static_cast<tree::s32>(std::distance(set.begin(), bound)), left.size());
+        EXPECT_EQ(static_cast<tree::s32>(std::distance(bound, set.end())), right.size());
+        EXPECT_TRUE(std::equal(set.begin(), bound, left.begin()));
+        EXPECT_TRUE(std::equal(bound, set.end(), right.begin()));
+        if(left.end() != left.max()) {
+            EXPECT_LT(left.get(left.max()), key);
+        }
+        if(right.end() != right.min()) {
+            EXPECT_TRUE(key <= right.get(right.min()));
+        }
+
+        //Both of the trees are still valid AVL trees
+        for(int i = 0; i < 64; ++i) {
+            int value = static_cast<int>(random()%4096);
+            if(value<key) {
+                set.insert(value);
+                left.insert(tree::move(value));
+            } else {
+                set.erase(value);
+                right.remove(value);
+            }
+        }
+
+        left.join(right);
+        EXPECT_EQ(0, right.size());
+        EXPECT_EQ(right.end(), right.min());
+        EXPECT_EQ(set.size(), static_cast<size_t>(left.size()));
+        EXPECT_TRUE(std::equal(set.begin(), set.end(), left.begin()));
+        for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+            EXPECT_EQ(*itr, left.get(left.find(*itr)));
+        }
+    }
+}
+
+TEST_CASE("TestAVL_SharedPool")
+{
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    tree::AVLTree<int> left;
+    tree::AVLTree<int> right;
+    EXPECT_FALSE(left.shares_pool(right));
+    right.share_pool(left);
+    EXPECT_TRUE(left.shares_pool(right));
+    EXPECT_TRUE(right.shares_pool(left));
+
+    for(int n = 0; n < 64; ++n) {
+        std::set<int> set;
+        int count = static_cast<int>(random()%2048);
+        for(int i = 0; i < count; ++i) {
+            int value = static_cast<int>(random()%4096);
+            set.insert(value);
+            left.insert(tree::move(value));
+        }
+        std::vector<tree::s32> positions;
+        for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+            positions.push_back(left.find(*itr));
+        }
+
+        //The nodes are relinked, not moved
+        int key = static_cast<int>(random()%4098) - 1;
+        left.split(key, right);
+        std::set<int>::iterator bound = set.lower_bound(key);
+        EXPECT_EQ(static_cast<tree::s32>(std::distance(set.begin(), bound)), left.size());
+        EXPECT_EQ(static_cast<tree::s32>(std::distance(bound, set.end())), right.size());
+        EXPECT_TRUE(std::equal(set.begin(), bound, left.begin()));
+        EXPECT_TRUE(std::equal(bound, set.end(), right.begin()));
+        size_t index = 0;
+        for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr, ++index) {
+            EXPECT_EQ(positions[index], (*itr<key)? left.find(*itr) : right.find(*itr));
+        }
+
+        //Both trees take nodes from the pool, which may grow
+        for(int i = 0; i < 256; ++i) {
+            int value = static_cast<int>(random()%4096);
+            if(value<key) {
+                set.insert(value);
+                left.insert(tree::move(value));
+            } else {
+                set.insert(value);
+                right.insert(tree::move(value));
+            }
+        }
+
+        left.join(right);
+        EXPECT_EQ(0, right.size());
+        EXPECT_EQ(right.end(), right.min());
+        EXPECT_EQ(set.size(), static_cast<size_t>(left.size()));
+        EXPECT_TRUE(std::equal(set.begin(), set.end(), left.begin()));
+        for(std::set<int>::iterator itr = set.begin(); itr != set.end(); ++itr) {
+            EXPECT_EQ(*itr, left.get(left.find(*itr)));
+        }
+
+        //The set operations on the pool
+        std::set<int> other;
+        for(int i = 0; i < 512; ++i) {
+            int value = static_cast<int>(random()%4096);
+            other.insert(value);
+            right.insert(tree::move(value));
+        }
+        std::vector<int> expected;
+        switch(n%3) {
+        case 0:
+            std::set_union(set.begin(), set.end(), other.begin(), other.end(), std::back_inserter(expected));
+            left.set_union(right);
+            break;
+        case 1:
+            std::set_intersection(set.begin(), set.end(), other.begin(), other.end(), std::back_inserter(expected));
+            left.set_intersection(right);
+            break;
+        default:
+            std::set_difference(set.begin(), set.end(), other.begin(), other.end(), std::back_inserter(expected));
+            left.set_difference(right);
+            break;
+        }
+        EXPECT_EQ(0, right.size());
+        EXPECT_EQ(expected.size(), static_cast<size_t>(left.size()));
+        EXPECT_TRUE(std::equal(expected.begin(), expected.end(), left.begin()));
+        left.clear();
+    }
+
+    SECTION("build and batches in a shared pool")
+    {
+        std::vector<int> values(1000);
+        for(int i = 0; i < 1000; ++i) {
+            values[i] = i*2;
+        }
+        right.insert(-1);
+        left.build_from_sorted(&values[0], 1000);
+        EXPECT_EQ(1000, left.size());
+        EXPECT_EQ(1, right.size());
+        for(int i = 0; i < 1000; ++i) {
+            EXPECT_EQ(i*2, left.get(left.find(i*2)));
+        }
+        std::vector<int> batch(1000);
+        for(int i = 0; i < 1000; ++i) {
+            batch[i] = i*2 + 1;
+        }
+        EXPECT_EQ(1000, left.insert_batch(&batch[0], 1000));
+        for(int i = 0; i < 1000; ++i) {
+            batch[i] = i*2;
+        }
+        EXPECT_EQ(1000, left.remove_batch(&batch[0], 1000));
+        EXPECT_EQ(1000, left.size());
+        EXPECT_EQ(1, right.size());
+        EXPECT_EQ(-1, right.get(right.min()));
+        for(int i = 0; i < 1000; ++i) {
+            EXPECT_EQ(i*2 + 1, left.get(left.find(i*2 + 1)));
+        }
+    }
+
+    SECTION("swap with a tree of own pool")
+    {
+        left.insert(1);
+        right.insert(2);
+        tree::AVLTree<int> own;
+        own.insert(3);
+        own.swap(left);
+        EXPECT_TRUE(own.shares_pool(right));
+        EXPECT_FALSE(left.shares_pool(right));
+        own.join(left);
+        EXPECT_EQ(2, own.size());
+        EXPECT_EQ(3, own.get(own.max()));
+        EXPECT_TRUE(own.shares_pool(right));
+        EXPECT_EQ(2, right.get(right.min()));
+    }
+
+    SECTION("the pool outlives the tree which created it")
+    {
+        tree::AVLTree<int>* first = new tree::AVLTree<int>();
+        tree::AVLTree<int> second;
+        second.share_pool(*first);
+        for(int i = 0; i < 100; ++i) {
+            first->insert(tree::move(i));
+        }
+        first->split(50, second);
+        delete first;
+        EXPECT_EQ(50, second.size());
+        for(int i = 100; i < 200; ++i) {
+            second.insert(tree::move(i));
+        }
+        EXPECT_EQ(150, second.size());
+        EXPECT_EQ(50, second.get(second.min()));
+    }
+}
+
+TEST_CASE("TestAVL_SetOperations")
+{
+    typedef tree::AVLTree<Record, tree::DefaultAVLAllocator, RecordComparator> Tree;
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    for(int n = 0; n < 96; ++n) {
+        Tree tree0;
+        Tree tree1;
+        std::set<int> set0;
+        std::set<int> set1;
+        //Either of the trees can be the smaller
+        int count0 = static_cast<int>(random()%((n&1)? 2048 : 64));
+        int count1 = static_cast<int>(random()%((n&2)? 2048 : 64));
+        for(int i = 0; i < count0; ++i) {
+            int key = static_cast<int>(random()%2048);
+            set0.insert(key);
+            tree0.emplace(key, "0");
+        }
+        for(int i = 0; i < count1; ++i) {
+            int key = static_cast<int>(random()%2048);
+            set1.insert(key);
+            tree1.emplace(key, "1");
+        }
+
+        std::vector<int> expected;
+        Tree copied;
+        switch(n%3) {
+        case 0:
+            std::set_union(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+            tree0.set_union(tree1, copied);
+            EXPECT_EQ(set0.size(), static_cast<size_t>(tree0.size()));
+            EXPECT_EQ(set1.size(), static_cast<size_t>(tree1.size()));
+            tree0.set_union(tree1);
+            break;
+        case 1:
+            std::set_intersection(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+            tree0.set_intersection(tree1, copied);
+            EXPECT_EQ(set0.size(), static_cast<size_t>(tree0.size()));
+            EXPECT_EQ(set1.size(), static_cast<size_t>(tree1.size()));
+            tree0.set_intersection(tree1);
+            break;
+        default:
+            std::set_difference(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+            tree0.set_difference(tree1, copied);
+            EXPECT_EQ(set0.size(), static_cast<size_t>(tree0.size()));
+            EXPECT_EQ(set1.size(), static_cast<size_t>(tree1.size()));
+            tree0.set_difference(tree1);
+            break;
+        }
+        //The copied result is the same as the in-place one
+        EXPECT_EQ(expected.size(), static_cast<size_t>(copied.size()));
+        Tree::const_iterator copiedItr = copied.begin();
+        for(Tree::const_iterator itr = tree0.begin(); itr != tree0.end() && copiedItr != copied.end(); ++itr, ++copiedItr) {
+            EXPECT_EQ(itr->key_, copiedItr->key_);
+            EXPECT_EQ(itr->name_, copiedItr->name_);
+        }
+        EXPECT_EQ(0, tree1.size());
+        EXPECT_EQ(tree1.end(), tree1.min());
+        EXPECT_EQ(expected.size(), static_cast<size_t>(tree0.size()));
+
+        std::vector<int> keys;
+        for(Tree::const_iterator itr = tree0.begin(); itr != tree0.end(); ++itr) {
+            keys.push_back(itr->key_);
+            //The values of this tree are kept
+            bool inTree0 = (set0.end() != set0.find(itr->key_));
+            EXPECT_EQ(std::string(inTree0? "0" : "1"), itr->name_);
+        }
+        EXPECT_EQ(expected, keys);
+        for(size_t i = 0; i < expected.size(); ++i) {
+            EXPECT_EQ(expected[i], tree0.get(tree0.find(Record(expected[i], ""))).key_);
+        }
+    }
+}
+
+TEST_CASE("TestAVL_ParallelSetOperations")
+{
+    typedef tree::AVLTree<Record, tree::DefaultAVLAllocator, RecordComparator> Tree;
+    std::random_device device;
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    //Large enough to fork at the upper levels
+    const int Range = 1<<16;
+    for(tree::s32 threads = 1; threads <= 4; ++threads) {
+        tree::WorkStealingPool pool(threads);
+        for(int n = 0; n < 10; ++n) {
+            Tree tree0;
+            Tree tree1;
+            std::set<int> set0;
+            std::set<int> set1;
+            int count0 = static_cast<int>(random()%((n&1)? Range : Range/16));
+            int count1 = static_cast<int>(random()%((n&2)? Range : Range/16));
+            for(int i = 0; i < count0; ++i) {
+                int key = static_cast<int>(random()%Range);
+                set0.insert(key);
+                tree0.emplace(key, "0");
+            }
+            std::vector<Record> batch;
+            for(int i = 0; i < count1; ++i) {
+                int key = static_cast<int>(random()%Range);
+                set1.insert(key);
+                tree1.emplace(key, "1");
+                batch.push_back(Record(key, "1"));
+            }
+
+            std::vector<int> expected;
+            tree::s32 count = 0;
+            switch(n%5) {
+            case 0:
+                std::set_union(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+                tree0.parallel_set_union(pool, tree1);
+                break;
+            case 1:
+                std::set_intersection(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+                tree0.parallel_set_intersection(pool, tree1);
+                break;
+            case 2:
+                std::set_difference(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+                tree0.parallel_set_difference(pool, tree1);
+                break;
+            case 3:
+                std::set_union(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+                tree1.clear();
+                count = tree0.parallel_insert_batch(pool, batch.data(), static_cast<tree::s32>(batch.size()));
+                EXPECT_EQ(expected.size()-set0.size(), static_cast<size_t>(count));
+                break;
+            default:
+                std::set_difference(set0.begin(), set0.end(), set1.begin(), set1.end(), std::back_inserter(expected));
+                tree1.clear();
+                count = tree0.parallel_remove_batch(pool, batch.data(), static_cast<tree::s32>(batch.size()));
+                EXPECT_EQ(set0.size()-expected.size(), static_cast<size_t>(count));
+                break;
+            }
+            EXPECT_EQ(0, tree1.size());
+            EXPECT_EQ(expected.size(), static_cast<size_t>(tree0.size()));
+
+            std::vector<int> keys;
+            for(Tree::const_iterator itr = tree0.begin(); itr != tree0.end(); ++itr) {
+                keys.push_back(itr->key_);
+                bool inTree0 = (set0.end() != set0.find(itr->key_));
+                EXPECT_EQ(std::string(inTree0? "0" : "1"), itr->name_);
+            }
+            EXPECT_EQ(expected, keys);
+
+            //The released nodes are reused
+            for(int i = 0; i < 256; ++i) {
+                int key = static_cast<int>(random()%Range);
+                tree0.emplace(key, "0");
+                tree1.emplace(key, "1");
+            }
+            for(Tree::const_iterator itr = tree0.begin(); itr != tree0.end(); ++itr) {
+                EXPECT_EQ(itr->key_, tree0.get(tree0.find(*itr)).key_);
+            }
+        }
+    }
+}
+
+TEST_CASE("TestAVL_EraseRange")
+{
+    std::random_device device;
+    const int Samples = 2048;
+    tree::AVLTree<int> avlTree;
+    std::set<int> set;
+
+    tree::u32 seed = device();
+    std::cout << "seed:" << seed << std::endl;
+    std::mt19937 random(seed);
+
+    EXPECT_EQ(0, avlTree.erase_range(0, Samples));
+
+    for(int n = 0; n < 256; ++n) {
+        while(static_cast<int>(set.size()) < Samples/2) {
+            int value = static_cast<int>(random()%Samples);
+            set.insert(value);
+            avlTree.insert(tree::move(value));
+        }
+        //Empty, reversed and outer ranges included
+        int lower = static_cast<int>(random()%(Samples+64)) - 32;
+        int upper = lower + static_cast<int>(random()%((n&1)? Samples : 64)) - 8;
+        std::set<int>::iterator begin = set.lower_bound(lower);
+        std::set<int>::iterator end = (lower < upper)? set.lower_bound(upper) : begin;
+        tree::s32 expected = static_cast<tree::s32>(std::distance(begin, end));
+        set.erase(begin, end);
+
+        EXPECT_EQ(expected, avlTree.erase_range(lower, upper));
+        EXPECT_EQ(set.size(), static_cast<size_t>(avlTree.size()));
+        EXPECT_TRUE(std::equal(set.begin(), set.end(), avlTree.begin()));
+        if(set.empty()) {
+            EXPECT_EQ(avlTree.end(), avlTree.min());
+        } else {
+            EXPECT_EQ(*set.begin(), avlTree.get(avlTree.min()));
+            EXPECT_EQ(*set.rbegin(), avlTree.get(avlTree.max()));
+        }
+    }
+
+    EXPECT_EQ(static_cast<tree::s32>(set.size()), avlTree.erase_range(-1, Samples));
+    EXPECT_EQ(0, avlTree.size());
+}
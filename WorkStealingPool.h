@@ -0,0 +1,233 @@
+#ifndef INC_TREE_WORKSTEALINGPOOL_H_
+#define INC_TREE_WORKSTEALINGPOOL_H_
+/**
+@file WorkStealingPool.h
+@author t-sakai
+*/
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "common.h"
+
+namespace tree
+{
+    //---------------------------------------------------------------
+    //---
+    //--- WorkStealingPool
+    //---
+    //---------------------------------------------------------------
+    /**
+    @brief Thread pool, each worker has own queue and steals from the others when it is empty
+
+    Tasks are spawned into a TaskGroup, and wait(group) executes queued tasks until the group completes,
+    so tasks can spawn and wait nested tasks (fork-join). Tasks should not throw.
+    */
+    class WorkStealingPool
+    {
+    public:
+        typedef std::function<void()> task_type;
+
+        class TaskGroup
+        {
+        public:
+            TaskGroup()
+                :pending_(0)
+            {}
+
+        private:
+            friend class WorkStealingPool;
+
+            TaskGroup(const TaskGroup&) = delete;
+            TaskGroup& operator=(const TaskGroup&) = delete;
+
+            std::atomic<s32> pending_;
+        };
+
+        /**
+        @param numThreads ... number of threads which execute tasks, including a thread calling wait
+        */
+        explicit WorkStealingPool(s32 numThreads);
+        ~WorkStealingPool();
+
+        /// Number of threads which execute tasks, including a thread calling wait
+        inline s32 size() const;
+
+        void spawn(TaskGroup& group, task_type&& task);
+        void wait(TaskGroup& group);
+
+    private:
+        WorkStealingPool(const WorkStealingPool&) = delete;
+        WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+        struct Queue
+        {
+            std::mutex mutex_;
+            std::deque<task_type> tasks_;
+        };
+
+        struct Current
+        {
+            WorkStealingPool* pool_;
+            s32 index_;
+        };
+
+        static Current& current();
+        inline s32 currentIndex();
+
+        bool pop(s32 index, task_type& task);
+        void proc(s32 index);
+
+        s32 numQueues_;
+        Queue* queues_;
+        std::vector<std::thread> threads_;
+
+        std::atomic<s32> queued_;
+        bool stop_;
+        std::mutex sleepMutex_;
+        std::condition_variable sleepCondition_;
+    };
+
+    //---------------------------------------------------------------
+    // Queue 0 is shared by the threads outside of the pool
+    inline WorkStealingPool::WorkStealingPool(s32 numThreads)
+        :numQueues_((numThreads<1)? 1 : numThreads)
+        ,queues_(NULL)
+        ,queued_(0)
+        ,stop_(false)
+    {
+        queues_ = TNEW Queue[numQueues_];
+        threads_.reserve(numQueues_-1);
+        for(s32 i=1; i<numQueues_; ++i){
+            threads_.push_back(std::thread(&WorkStealingPool::proc, this, i));
+        }
+    }
+
+    //---------------------------------------------------------------
+    inline WorkStealingPool::~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stop_ = true;
+        }
+        sleepCondition_.notify_all();
+        for(size_t i=0; i<threads_.size(); ++i){
+            threads_[i].join();
+        }
+        TDELETE_ARRAY(queues_);
+    }
+
+    //---------------------------------------------------------------
+    inline s32 WorkStealingPool::size() const
+    {
+        return numQueues_;
+    }
+
+    //---------------------------------------------------------------
+    inline void WorkStealingPool::spawn(TaskGroup& group, task_type&& task)
+    {
+        group.pending_.fetch_add(1);
+        TaskGroup* pgroup = &group;
+        task_type wrapped(std::bind([pgroup](task_type& t){
+            t();
+            pgroup->pending_.fetch_sub(1);
+        }, tree::move(task)));
+
+        Queue& queue = queues_[currentIndex()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex_);
+            queue.tasks_.push_back(tree::move(wrapped));
+        }
+        queued_.fetch_add(1);
+        {
+            //Do not lose the notification to a worker going to sleep
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+        }
+        sleepCondition_.notify_one();
+    }
+
+    //---------------------------------------------------------------
+    inline void WorkStealingPool::wait(TaskGroup& group)
+    {
+        s32 index = currentIndex();
+        task_type task;
+        while(0<group.pending_.load()){
+            if(pop(index, task)){
+                task();
+                task = task_type();
+            }else{
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    //---------------------------------------------------------------
+    inline WorkStealingPool::Current& WorkStealingPool::current()
+    {
+        static thread_local Current current = {NULL, 0};
+        return current;
+    }
+
+    //---------------------------------------------------------------
+    inline s32 WorkStealingPool::currentIndex()
+    {
+        Current& c = current();
+        return (this == c.pool_)? c.index_ : 0;
+    }
+
+    //---------------------------------------------------------------
+    // Take the newest task of own queue, or steal the oldest task of another queue
+    inline bool WorkStealingPool::pop(s32 index, task_type& task)
+    {
+        if(queued_.load()<=0){
+            return false;
+        }
+        {
+            Queue& queue = queues_[index];
+            std::lock_guard<std::mutex> lock(queue.mutex_);
+            if(!queue.tasks_.empty()){
+                task = tree::move(queue.tasks_.back());
+                queue.tasks_.pop_back();
+                queued_.fetch_sub(1);
+                return true;
+            }
+        }
+        for(s32 i=1; i<numQueues_; ++i){
+            Queue& queue = queues_[(index+i)%numQueues_];
+            std::lock_guard<std::mutex> lock(queue.mutex_);
+            if(!queue.tasks_.empty()){
+                task = tree::move(queue.tasks_.front());
+                queue.tasks_.pop_front();
+                queued_.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //---------------------------------------------------------------
+    inline void WorkStealingPool::proc(s32 index)
+    {
+        Current& c = current();
+        c.pool_ = this;
+        c.index_ = index;
+
+        task_type task;
+        for(;;){
+            if(pop(index, task)){
+                task();
+                task = task_type();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            sleepCondition_.wait(lock, [this]{ return stop_ || 0<queued_.load(); });
+            if(stop_){
+                break;
+            }
+        }
+    }
+}
+#endif //INC_TREE_WORKSTEALINGPOOL_H_
@@ -21,6 +21,15 @@
 
 #define TASSERT(exp) assert(exp)
 
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define TPREFETCH(ptr) _mm_prefetch(reinterpret_cast<const char*>(ptr), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define TPREFETCH(ptr) __builtin_prefetch((ptr))
+#else
+#define TPREFETCH(ptr)
+#endif
+
 #define TNEW new
 #define TPLACEMENT_NEW(ptr) new(ptr)
 #define TDELETE(ptr) delete (ptr); (ptr)=NULL
@@ -99,6 +108,7 @@ namespace tree
 #endif
 
     using std::move;
+    using std::forward;
 
     template<class T>
     void swap(T& x0, T& x1)
@@ -111,7 +121,7 @@ namespace tree
     //---------------------------------------------------------
     struct DefaultAllocator
     {
-        static inline void* malloc(u32 size)
+        static inline void* malloc(size_t size)
         {
             return ::malloc(size);
         }
@@ -147,5 +157,29 @@ namespace tree
         {
         }
     };
+
+    /**
+    Call a traversal functor, a functor returning false stops the traversal
+    */
+    template<class Result>
+    struct TraversalInvoker
+    {
+        template<class Traversal, class U>
+        static inline bool invoke(Traversal& traversal, U& value)
+        {
+            return traversal(value)? true : false;
+        }
+    };
+
+    template<>
+    struct TraversalInvoker<void>
+    {
+        template<class Traversal, class U>
+        static inline bool invoke(Traversal& traversal, U& value)
+        {
+            traversal(value);
+            return true;
+        }
+    };
 }
 #endif //INC_TREE_COMMON_H__